@@ -1,7 +1,31 @@
 #include <getopt.h>
-#include "../core/dispatcher.h"
+#include "../core/solver_registry.h"
 #include "sql_types.h"
 #include "reaction_network.h"
+#include "tau_leaping_simulation.h"
+#include "langevin_simulation.h"
+#include "hybrid_simulation.h"
+#include "slow_scale_simulation.h"
+
+// the partial propensity and approximate simulations depend
+// on the mass action structure of a reaction network, so they are only
+// available for GMC.
+template <>
+struct ModelSolvers<ReactionNetwork> {
+    template <typename F>
+    static void for_each(F f) {
+        f("partial_propensity",
+          SolverEntry<TreeSolver, PartialPropensitySimulation>());
+        f("tau_leaping",
+          SolverEntry<TreeSolver, TauLeapingSimulation, false>());
+        f("langevin",
+          SolverEntry<TreeSolver, LangevinSimulation, false>());
+        f("hybrid",
+          SolverEntry<TreeSolver, HybridSimulation, false>());
+        f("slow_scale",
+          SolverEntry<TreeSolver, SlowScaleSimulation, false>());
+    };
+};
 
 void print_usage() {
     std::cout << "Usage: specify the following options\n"
@@ -11,11 +35,20 @@ void print_usage() {
               << "--base_seed\n"
               << "--thread_count\n"
               << "--step_cutoff\n"
-              << "--dependency_threshold\n";
+              << "--dependency_threshold\n"
+              << "--solver (optional, default tree): "
+              << solver_names<ReactionNetwork>() << "\n"
+              << "--tau_epsilon (optional, default 0.03)\n"
+              << "--snapshot_interval (optional, default 0)\n"
+              << "--langevin_dt (required for --solver=langevin)\n"
+              << "--hybrid_dt (required for --solver=hybrid)\n"
+              << "--stop (optional): condition for stopping a trajectory early\n";
 }
 
 int main(int argc, char **argv) {
-    if (argc != 8) {
+    // --solver, --tau_epsilon, --snapshot_interval, --langevin_dt,
+    // --hybrid_dt and --stop are optional
+    if (argc < 8 || argc > 14) {
         print_usage();
         exit(EXIT_FAILURE);
     }
@@ -29,10 +62,21 @@ int main(int argc, char **argv) {
         {"thread_count", required_argument, NULL, 5},
         {"step_cutoff", required_argument, NULL, 6},
         {"dependency_threshold", required_argument, NULL, 7},
+        {"solver", required_argument, NULL, 8},
+        {"tau_epsilon", required_argument, NULL, 9},
+        {"snapshot_interval", required_argument, NULL, 10},
+        {"langevin_dt", required_argument, NULL, 11},
+        {"hybrid_dt", required_argument, NULL, 12},
+        {"stop", required_argument, NULL, 13},
         {NULL, 0, NULL, 0}
         // last element of options array needs to be filled with zeros
     };
 
+    // options 1 to 7 are required. The argument count alone can't tell
+    // whether one of them was left out in favor of an optional one.
+    constexpr int number_of_required_options = 7;
+    bool seen[number_of_required_options + 1] = {};
+
     int c;
     int option_index = 0;
 
@@ -41,14 +85,23 @@ int main(int argc, char **argv) {
     int number_of_simulations = 0;
     int base_seed = 0;
     int thread_count = 0;
-    int step_cutoff = 0;
+    long int step_cutoff = 0;
     int dependency_threshold = 0;
+    std::string solver = "tree";
+    double tau_epsilon = 0.03;
+    double snapshot_interval = 0.0;
+    double langevin_dt = 0.0;
+    double hybrid_dt = 0.0;
+    std::string stop = "";
 
     while ((c = getopt_long_only(
                 argc, argv, "",
                 long_options,
                 &option_index)) != -1) {
 
+        if (c >= 1 && c <= number_of_required_options)
+            seen[c] = true;
+
         switch (c) {
 
         case 1:
@@ -72,13 +125,37 @@ int main(int argc, char **argv) {
             break;
 
         case 6:
-            step_cutoff = atoi(optarg);
+            step_cutoff = atol(optarg);
             break;
 
         case 7:
             dependency_threshold = atoi(optarg);
             break;
 
+        case 8:
+            solver = optarg;
+            break;
+
+        case 9:
+            tau_epsilon = atof(optarg);
+            break;
+
+        case 10:
+            snapshot_interval = atof(optarg);
+            break;
+
+        case 11:
+            langevin_dt = atof(optarg);
+            break;
+
+        case 12:
+            hybrid_dt = atof(optarg);
+            break;
+
+        case 13:
+            stop = optarg;
+            break;
+
         default:
             // if an unexpected argument is passed, exit
             print_usage();
@@ -89,27 +166,55 @@ int main(int argc, char **argv) {
 
     }
 
+    for (int i = 1; i <= number_of_required_options; i++) {
+        if (! seen[i]) {
+            print_usage();
+            exit(EXIT_FAILURE);
+        }
+    }
+
     ReactionNetworkParameters parameters = {
-        .dependency_threshold = dependency_threshold };
+        .dependency_threshold = dependency_threshold,
+        .tau_epsilon = tau_epsilon,
+        .snapshot_interval = snapshot_interval,
+        .langevin_dt = langevin_dt,
+        .hybrid_dt = hybrid_dt };
+
+    if ((solver == "langevin" && langevin_dt <= 0.0) ||
+        (solver == "hybrid" && hybrid_dt <= 0.0)) {
+        print_usage();
+        exit(EXIT_FAILURE);
+    }
+
+    std::optional<StoppingCondition> stopping_condition =
+        stop.empty() ? StoppingCondition () : StoppingCondition::parse(stop);
 
-    Dispatcher<
-        TreeSolver,
+    if (! stopping_condition) {
+        print_usage();
+        exit(EXIT_FAILURE);
+    }
+
+    bool found = run_dispatcher<
         ReactionNetwork,
         ReactionNetworkParameters,
         TrajectoriesSql
-        >
-
-        dispatcher (
-        reaction_database,
-        initial_state_database,
-        number_of_simulations,
-        base_seed,
-        thread_count,
-        step_cutoff,
-        parameters
-        );
-
-    dispatcher.run_dispatcher();
+        > (
+            solver,
+            reaction_database,
+            initial_state_database,
+            number_of_simulations,
+            base_seed,
+            thread_count,
+            step_cutoff,
+            parameters,
+            stopping_condition.value()
+            );
+
+    if (! found) {
+        print_usage();
+        exit(EXIT_FAILURE);
+    }
+
     exit(EXIT_SUCCESS);
 
 
@@ -0,0 +1,505 @@
+#pragma once
+#include <cmath>
+#include <gsl/gsl_errno.h>
+#include <gsl/gsl_odeiv2.h>
+#include "reaction_network.h"
+#include "../core/firing_recorder.h"
+
+// hybrid simulation with dynamic partitioning into fast reactions,
+// which are integrated deterministically, and slow reactions, which
+// are simulated exactly, as described in
+// https://doi.org/10.1063/1.1835951
+//
+// A reaction is fast while it fires at least fast_firings times per
+// hybrid_dt and all of its reactants have at least fast_count copies.
+// The extents of the fast reactions (the number of times they have
+// fired, as a real number) are integrated with an adaptive RK45
+// method for at most hybrid_dt at a time, together with the integral
+// of the slow propensities, which change with the fast species. A
+// slow reaction fires once the integral reaches an exponential
+// variate. The slow reaction is sampled by the solver, which holds
+// the propensities of the slow reactions and zero for the fast ones.
+//
+// As in the langevin simulation, whole firings of the fast reactions
+// are moved into the integer state and recorded at the end of each
+// integration, and the fractional part is carried over. The partition
+// is updated for the reactions depending on a changed species, and
+// only the slow reactions which have a reactant changed by a fast
+// reaction enter the integral explicitly.
+//
+// This only samples the distribution approximately, so it is never
+// picked by --solver=auto. Firings are recorded with a
+// FiringRecorder. This works with ReactionNetwork only. step counts
+// the history elements, and the simulation stops once more than
+// step_cutoff reactions have fired. If an integration fails, the
+// trajectory ends there.
+
+// GSL integrator objects for the fast system, which has one dimension
+// for the extent of each fast reaction and one for the integral of the
+// slow propensities. Setting them up costs more than a short
+// integration, so they are kept and reset between integrations, and
+// only reallocated when the number of fast reactions changes.
+struct OdeWorkspace {
+    unsigned long int dimension;
+    double tolerance;
+    gsl_odeiv2_step *stepper;
+    gsl_odeiv2_control *control;
+    gsl_odeiv2_evolve *evolve;
+
+    OdeWorkspace(double tolerance) :
+        dimension (0),
+        tolerance (tolerance),
+        stepper (nullptr),
+        control (nullptr),
+        evolve (nullptr) {};
+
+    ~OdeWorkspace() { free(); };
+
+    // GSL objects can't be copied
+    OdeWorkspace(OdeWorkspace &other) = delete;
+    OdeWorkspace &operator=(OdeWorkspace &other) = delete;
+
+    // get ready for an integration of a system with new_dimension
+    // equations, as if the objects had just been allocated
+    void prepare(unsigned long int new_dimension);
+    void free();
+};
+
+void OdeWorkspace::prepare(unsigned long int new_dimension) {
+    if (new_dimension == dimension) {
+        gsl_odeiv2_step_reset(stepper);
+        gsl_odeiv2_evolve_reset(evolve);
+        return;
+    }
+
+    free();
+    dimension = new_dimension;
+    stepper = gsl_odeiv2_step_alloc(gsl_odeiv2_step_rkf45, dimension);
+    control = gsl_odeiv2_control_y_new(tolerance, tolerance);
+    evolve = gsl_odeiv2_evolve_alloc(dimension);
+};
+
+void OdeWorkspace::free() {
+    if (evolve) gsl_odeiv2_evolve_free(evolve);
+    if (control) gsl_odeiv2_control_free(control);
+    if (stepper) gsl_odeiv2_step_free(stepper);
+    evolve = nullptr;
+    control = nullptr;
+    stepper = nullptr;
+    dimension = 0;
+};
+
+template <typename Solver, typename Model>
+struct HybridSimulation {
+    Model &model;
+    unsigned long int seed;
+    std::vector<int> state;
+
+    // state plus the unrecorded firings of the fast reactions. Only
+    // differs from state during an integration.
+    std::vector<double> continuous_state;
+    double time;
+    long int step; // number of history elements
+    std::vector<double> propensities;
+
+    std::vector<bool> fast;
+    std::vector<int> fast_reactions;
+    std::vector<int> fast_positions; // position of a reaction in fast_reactions
+    std::vector<double> extents; // unrecorded firings of each fast reaction
+
+    // species changed by fast reactions, and the slow reactions with a
+    // reactant among them
+    std::vector<int> fast_species;
+    std::vector<int> coupled_reactions;
+    std::vector<bool> species_marks;
+    std::vector<bool> reaction_marks;
+
+    // sum of the slow propensities which don't change during an
+    // integration
+    double uncoupled_propensity_sum;
+
+    // exponential variate minus the slow propensity integral so far
+    double remaining_integral;
+
+    // only used to construct the solver, which keeps its own copy
+    std::vector<double> slow_propensities;
+    Solver solver; // samples slow reactions
+    Sampler sampler; // waiting times of slow reactions
+    History history;
+    FiringRecorder recorder;
+    std::vector<Update> update_buffer;
+    std::vector<int> changed_species;
+    std::vector<bool> species_changed;
+
+    // fast extents followed by the slow propensity integral
+    std::vector<double> ode_state;
+    std::vector<double> saved_ode_state;
+    double ode_step; // step size of the integrator, kept between integrations
+    OdeWorkspace ode_workspace;
+    bool integration_failed;
+
+    static constexpr double fast_firings = 10.0;
+    static constexpr int fast_count = 100;
+    static constexpr double ode_tolerance = 1e-6;
+
+    // the waiting time sampler needs a stream which is independent from
+    // the solver, which is seeded with seed.
+    static constexpr unsigned long int slow_seed_mask = 0x4b1d;
+
+    HybridSimulation(Model &model,
+                     unsigned long int seed,
+
+                     // a step records many firings, so the history
+                     // length doesn't follow from the step cutoff
+                     long int) :
+        model (model),
+        seed (seed),
+        state (model.initial_state),
+        continuous_state (state.begin(), state.end()),
+        time (0.0),
+        step (0),
+        propensities (model.initial_propensities),
+        fast (propensities.size(), false),
+        fast_positions (propensities.size(), -1),
+        extents (propensities.size(), 0.0),
+        species_marks (state.size(), false),
+        reaction_marks (propensities.size(), false),
+        uncoupled_propensity_sum (0.0),
+        slow_propensities (compute_initial_partition()),
+        solver (seed, std::ref(slow_propensities)),
+        sampler (seed, slow_seed_mask),
+        history (),
+        recorder (history, model.snapshot_interval, propensities.size()),
+        species_changed (state.size(), false),
+        ode_step (model.hybrid_dt),
+        ode_workspace (ode_tolerance),
+        integration_failed (false) {
+            slow_propensities.clear();
+            slow_propensities.shrink_to_fit();
+            remaining_integral = sampler.exponential();
+        };
+
+    bool is_fast(int reaction_index);
+    void set_fast(int reaction_index, bool value);
+    std::vector<double> compute_initial_partition();
+    void compute_coupling();
+    static int ode_function(double t, const double y[], double dydt[], void *params);
+    int compute_derivatives(const double y[], double dydt[]);
+    bool integrate(double end_time);
+    void apply_firings(int reaction_index, int count);
+    void record_fast_firings();
+    void fire_slow_reaction();
+    void update_propensities();
+    bool execute_step();
+    void execute_steps(long int step_cutoff);
+};
+
+
+template <typename Solver, typename Model>
+bool HybridSimulation<Solver, Model>::is_fast(int reaction_index) {
+    if (propensities[reaction_index] * model.hybrid_dt < fast_firings)
+        return false;
+
+    Reaction &reaction = model.reactions[reaction_index];
+    for (int m = 0; m < reaction.number_of_reactants; m++)
+        if (state[reaction.reactants[m]] < fast_count) return false;
+
+    return true;
+};
+
+template <typename Solver, typename Model>
+void HybridSimulation<Solver, Model>::set_fast(int reaction_index, bool value) {
+    if (fast[reaction_index] == value) return;
+    fast[reaction_index] = value;
+
+    if (value) {
+        fast_positions[reaction_index] = fast_reactions.size();
+        fast_reactions.push_back(reaction_index);
+        extents[reaction_index] = 0.0;
+    } else {
+        // swap remove
+        int position = fast_positions[reaction_index];
+        int last = fast_reactions.back();
+        fast_reactions[position] = last;
+        fast_positions[last] = position;
+        fast_reactions.pop_back();
+        fast_positions[reaction_index] = -1;
+    }
+};
+
+template <typename Solver, typename Model>
+std::vector<double> HybridSimulation<Solver, Model>::compute_initial_partition() {
+    std::vector<double> slow (propensities.size());
+    for (unsigned long int j = 0; j < propensities.size(); j++) {
+        set_fast(j, is_fast(j));
+        slow[j] = fast[j] ? 0.0 : propensities[j];
+    }
+
+    return slow;
+};
+
+template <typename Solver, typename Model>
+void HybridSimulation<Solver, Model>::compute_coupling() {
+    int species[4];
+    int changes[4];
+
+    fast_species.clear();
+    for (int j : fast_reactions) {
+        int number_of_changes = model.compute_net_changes(j, species, changes);
+        for (int k = 0; k < number_of_changes; k++) {
+            if (species_marks[species[k]]) continue;
+            species_marks[species[k]] = true;
+            fast_species.push_back(species[k]);
+        }
+    }
+
+    coupled_reactions.clear();
+    double coupled_propensity_sum = 0.0;
+    for (int i : fast_species) {
+        species_marks[i] = false;
+        for (int j : model.get_state_dependents(i)) {
+            if (fast[j] || reaction_marks[j]) continue;
+            reaction_marks[j] = true;
+            coupled_reactions.push_back(j);
+            coupled_propensity_sum += propensities[j];
+        }
+    }
+
+    for (int j : coupled_reactions) reaction_marks[j] = false;
+
+    uncoupled_propensity_sum = std::max(
+        solver.get_propensity_sum() - coupled_propensity_sum,
+        0.0);
+};
+
+template <typename Solver, typename Model>
+int HybridSimulation<Solver, Model>::ode_function(
+    double,
+    const double y[],
+    double dydt[],
+    void *params) {
+
+    HybridSimulation<Solver, Model> &simulation =
+        *(HybridSimulation<Solver, Model> *) params;
+
+    return simulation.compute_derivatives(y, dydt);
+};
+
+template <typename Solver, typename Model>
+int HybridSimulation<Solver, Model>::compute_derivatives(
+    const double y[],
+    double dydt[]) {
+
+    int species[4];
+    int changes[4];
+
+    for (int i : fast_species) continuous_state[i] = state[i];
+
+    for (unsigned long int k = 0; k < fast_reactions.size(); k++) {
+        int number_of_changes = model.compute_net_changes(
+            fast_reactions[k], species, changes);
+
+        for (int l = 0; l < number_of_changes; l++)
+            continuous_state[species[l]] += changes[l] * y[k];
+    }
+
+    for (unsigned long int k = 0; k < fast_reactions.size(); k++)
+        dydt[k] = std::max(
+            model.compute_propensity(continuous_state, fast_reactions[k]),
+            0.0);
+
+    double slow_propensity_sum = uncoupled_propensity_sum;
+    for (int j : coupled_reactions)
+        slow_propensity_sum += std::max(
+            model.compute_propensity(continuous_state, j),
+            0.0);
+
+    dydt[fast_reactions.size()] = slow_propensity_sum;
+    return GSL_SUCCESS;
+};
+
+// integrate the fast extents and the slow propensity integral up to
+// end_time, or until the integral reaches remaining_integral. Returns
+// true if a slow reaction fires, and leaves time at the end of the
+// integration. If GSL can't integrate the system, integration_failed
+// is set and the trajectory ends.
+template <typename Solver, typename Model>
+bool HybridSimulation<Solver, Model>::integrate(double end_time) {
+    unsigned long int dimension = fast_reactions.size() + 1;
+    ode_state.resize(dimension);
+    for (unsigned long int k = 0; k < fast_reactions.size(); k++)
+        ode_state[k] = extents[fast_reactions[k]];
+    ode_state[dimension - 1] = 0.0;
+
+    gsl_odeiv2_system system = {ode_function, nullptr, dimension, this};
+    ode_workspace.prepare(dimension);
+
+    auto apply = [&](double t1) {
+        int status = gsl_odeiv2_evolve_apply(
+            ode_workspace.evolve,
+            ode_workspace.control,
+            ode_workspace.stepper,
+            &system, &time, t1,
+            &ode_step, ode_state.data());
+
+        if (status != GSL_SUCCESS) {
+            std::cerr << time_stamp()
+                      << "hybrid: integration failed for seed "
+                      << seed
+                      << ", ending its trajectory\n";
+            integration_failed = true;
+        }
+
+        return ! integration_failed;
+    };
+
+    bool slow_event = false;
+    while (time < end_time) {
+        double start_time = time;
+        saved_ode_state = ode_state;
+        if (! apply(end_time)) break;
+
+        double start_integral = saved_ode_state.back();
+        double integral = ode_state.back();
+        if (integral >= remaining_integral) {
+            // the integral is nearly linear over a single step, so we
+            // interpolate the crossing and integrate up to it again.
+            double event_time = start_time + (time - start_time)
+                * (remaining_integral - start_integral)
+                / (integral - start_integral);
+
+            time = start_time;
+            ode_state = saved_ode_state;
+            gsl_odeiv2_evolve_reset(ode_workspace.evolve);
+            while (time < event_time && apply(event_time));
+
+            slow_event = ! integration_failed;
+            break;
+        }
+    }
+
+    for (unsigned long int k = 0; k < fast_reactions.size(); k++)
+        extents[fast_reactions[k]] = ode_state[k];
+
+    for (int i : fast_species) continuous_state[i] = state[i];
+    remaining_integral -= ode_state.back();
+    return slow_event;
+};
+
+template <typename Solver, typename Model>
+void HybridSimulation<Solver, Model>::apply_firings(int reaction_index, int count) {
+    int species[4];
+    int changes[4];
+
+    recorder.record(reaction_index, count, time);
+
+    int number_of_changes = model.compute_net_changes(
+        reaction_index, species, changes);
+
+    for (int k = 0; k < number_of_changes; k++) {
+        state[species[k]] += changes[k] * count;
+        if (! species_changed[species[k]]) {
+            species_changed[species[k]] = true;
+            changed_species.push_back(species[k]);
+        }
+    }
+};
+
+template <typename Solver, typename Model>
+void HybridSimulation<Solver, Model>::record_fast_firings() {
+    for (int j : fast_reactions) {
+        int count = std::min(
+            (double) model.compute_max_firings(state, j),
+            std::floor(extents[j]));
+
+        if (count <= 0) continue;
+
+        extents[j] -= count;
+        apply_firings(j, count);
+    }
+};
+
+template <typename Solver, typename Model>
+void HybridSimulation<Solver, Model>::fire_slow_reaction() {
+    // rounding the fast extents can leave no slow reaction which can
+    // fire, in which case the waiting time starts over.
+    std::optional<Event> maybe_event = solver.event();
+    if (maybe_event) apply_firings(maybe_event.value().index, 1);
+
+    remaining_integral = sampler.exponential();
+};
+
+// recompute the propensities and the partition of the reactions
+// depending on the species in changed_species
+template <typename Solver, typename Model>
+void HybridSimulation<Solver, Model>::update_propensities() {
+    for (int i : changed_species) {
+        species_changed[i] = false;
+        continuous_state[i] = state[i];
+    }
+
+    for (int i : changed_species) {
+        for (int j : model.get_state_dependents(i)) {
+            propensities[j] = model.compute_propensity(state, j);
+            set_fast(j, is_fast(j));
+            update_buffer.push_back(Update {
+                    .index = (unsigned long int) j,
+                    .propensity = fast[j] ? 0.0 : propensities[j]});
+        }
+    }
+
+    changed_species.clear();
+    solver.update(update_buffer);
+    update_buffer.clear();
+};
+
+template <typename Solver, typename Model>
+bool HybridSimulation<Solver, Model>::execute_step() {
+    recorder.advance(time);
+
+    double end_time = time + model.hybrid_dt;
+    if (recorder.snapshots() && end_time >= recorder.next_snapshot)
+        end_time = recorder.next_snapshot;
+
+    bool slow_event;
+    if (fast_reactions.empty()) {
+        // the slow propensities are constant, so this is an SSA step
+        double propensity_sum = solver.get_propensity_sum();
+        if (propensity_sum == 0.0) return false;
+
+        double event_time = time + remaining_integral / propensity_sum;
+        slow_event = event_time <= end_time;
+        if (slow_event) time = event_time;
+        else {
+            remaining_integral -= (end_time - time) * propensity_sum;
+            time = end_time;
+        }
+    } else {
+        compute_coupling();
+        slow_event = integrate(end_time);
+        if (integration_failed) return false;
+        record_fast_firings();
+    }
+
+    if (slow_event) {
+        // the slow reaction is sampled from the propensities after
+        // the fast firings
+        update_propensities();
+        fire_slow_reaction();
+    }
+
+    update_propensities();
+    step = history.size();
+    return true;
+};
+
+template <typename Solver, typename Model>
+void HybridSimulation<Solver, Model>::execute_steps(long int step_cutoff) {
+    while(execute_step()) {
+        if (recorder.number_of_firings > step_cutoff)
+            break;
+    }
+
+    recorder.finish(time);
+    step = history.size();
+};
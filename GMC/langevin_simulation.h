@@ -0,0 +1,143 @@
+#pragma once
+#include <cmath>
+#include "reaction_network.h"
+#include "../core/firing_recorder.h"
+
+// chemical Langevin equation, integrated with the Euler-Maruyama
+// method:
+// https://doi.org/10.1063/1.481811
+//
+// Over a step of length dt, the extent of reaction j (the number of
+// times it has fired, as a real number) grows by
+//
+// a_j dt + sqrt(a_j dt) N(0, 1)
+//
+// where a_j is the propensity at the start of the step. When every
+// species count is large, this is a good approximation of the SSA, and
+// the cost of a step doesn't depend on how many reactions fire. We
+// keep the part of each extent which hasn't been recorded yet, and
+// whole firings are moved into the state and recorded at the end of
+// each step, so the written trajectory and the state always agree and
+// propensities are computed by compute_propensity from integer
+// counts. A reaction can't fire more often than its reactants allow.
+// The extra firings stay in its extent, and fire once the reactants
+// are there. The noise can make an extent negative, which then has to
+// be made up before the reaction fires again.
+//
+// This only samples the distribution approximately, so it is never
+// picked by --solver=auto. Firings are recorded with a
+// FiringRecorder, so each reaction which fired in a step becomes a
+// single row of the leaps table rather than one row per firing, and
+// writing a step costs as little as taking it. This works with
+// ReactionNetwork only, since it needs the stoichiometry of the
+// reactions. No solver is needed, so Solver is ignored. step counts
+// the history elements, and the simulation stops once more than
+// step_cutoff reactions have fired.
+
+template <typename Solver, typename Model>
+struct LangevinSimulation {
+    Model &model;
+    unsigned long int seed;
+    std::vector<int> state;
+    double time;
+    long int step; // number of history elements
+    std::vector<double> propensities;
+    std::vector<double> extents; // unrecorded part of each extent
+    Sampler sampler;
+    History history;
+    FiringRecorder recorder;
+    std::vector<int> changed_species;
+    std::vector<bool> species_changed;
+
+    LangevinSimulation(Model &model,
+                       unsigned long int seed,
+
+                       // a step records many firings, so the history
+                       // length doesn't follow from the step cutoff
+                       long int) :
+        model (model),
+        seed (seed),
+        state (model.initial_state),
+        time (0.0),
+        step (0),
+        propensities (model.initial_propensities),
+        extents (propensities.size(), 0.0),
+        sampler (seed),
+        history (),
+        recorder (history, model.snapshot_interval, propensities.size()),
+        species_changed (state.size(), false) {};
+
+    bool execute_step();
+    void execute_steps(long int step_cutoff);
+};
+
+
+template <typename Solver, typename Model>
+bool LangevinSimulation<Solver, Model>::execute_step() {
+    recorder.advance(time);
+
+    double dt = model.langevin_dt;
+    bool at_snapshot = false;
+    if (recorder.snapshots() && time + dt >= recorder.next_snapshot) {
+        dt = recorder.next_snapshot - time;
+        at_snapshot = true;
+    }
+
+    bool active = false;
+    for (unsigned long int j = 0; j < propensities.size(); j++) {
+        if (propensities[j] == 0.0) continue;
+
+        active = true;
+        double mean = propensities[j] * dt;
+        extents[j] += mean + std::sqrt(mean) * sampler.gaussian();
+    }
+
+    if (! active) return false;
+
+    time = at_snapshot ? recorder.next_snapshot : time + dt;
+
+    int species[4];
+    int changes[4];
+    for (unsigned long int j = 0; j < propensities.size(); j++) {
+        if (extents[j] < 1.0) continue;
+
+        int count = std::min(
+            (double) model.compute_max_firings(state, j),
+            std::floor(extents[j]));
+
+        if (count == 0) continue;
+
+        extents[j] -= count;
+        recorder.record(j, count, time);
+
+        int number_of_changes = model.compute_net_changes(j, species, changes);
+        for (int k = 0; k < number_of_changes; k++) {
+            state[species[k]] += changes[k] * count;
+            if (! species_changed[species[k]]) {
+                species_changed[species[k]] = true;
+                changed_species.push_back(species[k]);
+            }
+        }
+    }
+
+    for (int i : changed_species) {
+        species_changed[i] = false;
+        for (int j : model.get_state_dependents(i))
+            propensities[j] = model.compute_propensity(state, j);
+    }
+
+    changed_species.clear();
+    step = history.size();
+    return true;
+};
+
+template <typename Solver, typename Model>
+void LangevinSimulation<Solver, Model>::execute_steps(long int step_cutoff) {
+    while(execute_step()) {
+        if (recorder.number_of_firings > step_cutoff)
+            break;
+    }
+
+    recorder.finish(time);
+    step = history.size();
+};
@@ -3,10 +3,14 @@
 #include <vector>
 #include <optional>
 #include <mutex>
+#include <limits>
+#include <array>
 #include "../core/sql.h"
 #include "sql_types.h"
 #include "../core/solvers.h"
 #include "../core/simulation.h"
+#include "../core/rejection_simulation.h"
+#include "../core/partial_propensity_simulation.h"
 
 struct Reaction {
     // we assume that each reaction has zero, one or two reactants
@@ -37,6 +41,12 @@ struct DependentsNode {
 // by the dispatcher which are model specific
 struct ReactionNetworkParameters {
     int dependency_threshold;
+
+    // only used by the tau leaping, langevin and hybrid simulations
+    double tau_epsilon;
+    double snapshot_interval;
+    double langevin_dt;
+    double hybrid_dt;
 };
 
 
@@ -54,6 +64,40 @@ struct ReactionNetwork {
 
     std::vector<DependentsNode> dependency_graph;
 
+    // bound on the relative change of a species count in a leap, the
+    // spacing of the time grid the approximate simulations record on,
+    // the time step of the langevin simulation and the longest
+    // integration of the hybrid simulation. If snapshot_interval is
+    // zero, every step is recorded.
+    double tau_epsilon;
+    double snapshot_interval;
+    double langevin_dt;
+    double hybrid_dt;
+
+    // maps species ids to reactions which have the species as a
+    // reactant. Only used by the rejection simulation, so it is
+    // computed on first use.
+    std::vector<std::vector<int>> species_reaction_dependency;
+    std::once_flag species_reaction_dependency_flag;
+
+    // state intervals for the rejection simulation are
+    // count +/- floor(state_bound_fraction * count). Rates in a
+    // network span many orders of magnitude, so for small counts even
+    // a width of 1 lets a fast reaction which can't fire dominate the
+    // upper bounds. Small counts get an exact interval instead.
+    static constexpr double state_bound_fraction = 0.1;
+
+    // rows of the partial propensity simulation. Only used by the
+    // partial propensity simulation, so it is computed on first use.
+    PartialPropensityTable partial_propensity_table;
+    std::once_flag partial_propensity_table_flag;
+
+    // pairs of reactions which undo each other, like A + B -> C and
+    // C -> A + B. Only used by the slow scale simulation, so it is
+    // computed on first use.
+    std::vector<std::pair<int, int>> reversible_pairs;
+    std::once_flag reversible_pairs_flag;
+
     ReactionNetwork(
         SqlConnection &reaction_network_database,
         SqlConnection &initial_state_database,
@@ -62,16 +106,33 @@ struct ReactionNetwork {
     std::optional<std::vector<int>> &get_dependency_node(int reaction_index);
     void compute_dependency_node(int reaction_index);
 
+    // State is std::vector<int>, or std::vector<double> for
+    // simulations which treat some counts as continuous.
+    template <typename State>
     double compute_propensity(
-        std::vector<int> &state,
+        State &state,
         int reaction_index);
 
     void update_state(
         std::vector<int> &state,
         int reaction_index);
 
+    // net change of each species by a single firing of reaction_index.
+    // Returns the number of species which change.
+    int compute_net_changes(
+        int reaction_index,
+        int species[4],
+        int changes[4]);
+
+    // number of times reaction_index can fire before one of its
+    // reactants runs out.
+    int compute_max_firings(
+        std::vector<int> &state,
+        int reaction_index);
+
+    template <typename UpdateFunction>
     void update_propensities(
-        std::function<void(Update update)> update_function,
+        UpdateFunction &&update_function,
         std::vector<int> &state,
         int next_reaction
         );
@@ -80,9 +141,44 @@ struct ReactionNetwork {
     // to a SQL type.
     TrajectoriesSql history_element_to_sql(
         int seed,
-        int step,
+        long int step,
         HistoryElement history_element);
 
+    // rejection simulation interface. See core/rejection_simulation.h
+    int changed_state_entries(
+        int reaction_index,
+        int changed_state[4]);
+
+    std::vector<int> &get_state_dependents(int species_id);
+
+    StateBounds compute_state_bounds(
+        std::vector<int> &state,
+        int species_id);
+
+    // mass action propensities are increasing in the species counts,
+    // so the bounds are the propensities at the ends of the intervals.
+    PropensityBounds compute_propensity_bounds(
+        std::vector<int> &lower_state,
+        std::vector<int> &upper_state,
+        int reaction_index);
+
+    // partial propensity simulation interface. See
+    // core/partial_propensity_simulation.h
+    PartialPropensityTable &get_partial_propensity_table();
+
+    // propensity of reaction_index divided by the count of the species
+    // in row. The rows of the table are chosen so that this depends on
+    // at most one other species.
+    double compute_partial_propensity(
+        std::vector<int> &state,
+        int reaction_index,
+        int row);
+
+    // reversible pairs as (forward, reverse) with forward < reverse.
+    // Both reactions need a positive rate, and each reaction is in at
+    // most one pair.
+    std::vector<std::pair<int, int>> &get_reversible_pairs();
+
 };
 
 ReactionNetwork::ReactionNetwork(
@@ -90,7 +186,11 @@ ReactionNetwork::ReactionNetwork(
      SqlConnection &initial_state_database,
      ReactionNetworkParameters parameters) :
 
-    dependency_threshold( parameters.dependency_threshold ) {
+    dependency_threshold( parameters.dependency_threshold ),
+    tau_epsilon( parameters.tau_epsilon ),
+    snapshot_interval( parameters.snapshot_interval ),
+    langevin_dt( parameters.langevin_dt ),
+    hybrid_dt( parameters.hybrid_dt ) {
 
     // collecting reaction network metadata
     SqlStatement<MetadataSql> metadata_statement (reaction_network_database);
@@ -268,8 +368,9 @@ void ReactionNetwork::compute_dependency_node(int reaction_index) {
     node.dependents = std::optional (std::move(dependents));
 };
 
+template <typename State>
 double ReactionNetwork::compute_propensity(
-    std::vector<int> &state,
+    State &state,
     int reaction_index) {
 
     Reaction &reaction = reactions[reaction_index];
@@ -323,8 +424,64 @@ void ReactionNetwork::update_state(
 }
 
 
+int ReactionNetwork::compute_net_changes(
+    int reaction_index,
+    int species[4],
+    int changes[4]) {
+
+    Reaction &reaction = reactions[reaction_index];
+    int count = 0;
+
+    auto add = [&](int i, int change) {
+        for (int k = 0; k < count; k++) {
+            if (species[k] == i) {
+                changes[k] += change;
+                return;
+            }
+        }
+        species[count] = i;
+        changes[count] = change;
+        count++;
+    };
+
+    for (int m = 0; m < reaction.number_of_reactants; m++)
+        add(reaction.reactants[m], -1);
+
+    for (int m = 0; m < reaction.number_of_products; m++)
+        add(reaction.products[m], 1);
+
+    // drop catalysts
+    int number_of_changes = 0;
+    for (int k = 0; k < count; k++) {
+        if (changes[k] == 0) continue;
+        species[number_of_changes] = species[k];
+        changes[number_of_changes] = changes[k];
+        number_of_changes++;
+    }
+
+    return number_of_changes;
+}
+
+int ReactionNetwork::compute_max_firings(
+    std::vector<int> &state,
+    int reaction_index) {
+
+    int species[4];
+    int changes[4];
+    int count = compute_net_changes(reaction_index, species, changes);
+
+    int result = std::numeric_limits<int>::max();
+    for (int k = 0; k < count; k++)
+        if (changes[k] < 0)
+            result = std::min(result, state[species[k]] / -changes[k]);
+
+    return result;
+}
+
+
+template <typename UpdateFunction>
 void ReactionNetwork::update_propensities(
-    std::function<void(Update update)> update_function,
+    UpdateFunction &&update_function,
     std::vector<int> &state,
     int next_reaction
     ) {
@@ -372,7 +529,7 @@ void ReactionNetwork::update_propensities(
 
 TrajectoriesSql ReactionNetwork::history_element_to_sql(
     int seed,
-    int step,
+    long int step,
     HistoryElement history_element) {
     return TrajectoriesSql {
         .seed = seed,
@@ -381,3 +538,243 @@ TrajectoriesSql ReactionNetwork::history_element_to_sql(
         .time = history_element.time
     };
 }
+
+int ReactionNetwork::changed_state_entries(
+    int reaction_index,
+    int changed_state[4]) {
+
+    Reaction &reaction = reactions[reaction_index];
+    int count = 0;
+
+    for (int m = 0; m < reaction.number_of_reactants; m++)
+        changed_state[count++] = reaction.reactants[m];
+
+    for (int m = 0; m < reaction.number_of_products; m++)
+        changed_state[count++] = reaction.products[m];
+
+    return count;
+}
+
+std::vector<int> &ReactionNetwork::get_state_dependents(int species_id) {
+
+    std::call_once(species_reaction_dependency_flag, [&] {
+        species_reaction_dependency.resize(initial_state.size());
+        for (unsigned long int j = 0; j < reactions.size(); j++) {
+            for (int m = 0; m < reactions[j].number_of_reactants; m++) {
+                // A + A only needs to be recorded once
+                if (m == 1 && reactions[j].reactants[0] == reactions[j].reactants[1])
+                    break;
+
+                species_reaction_dependency[reactions[j].reactants[m]].push_back(j);
+            }
+        }
+    });
+
+    return species_reaction_dependency[species_id];
+}
+
+StateBounds ReactionNetwork::compute_state_bounds(
+    std::vector<int> &state,
+    int species_id) {
+
+    int count = state[species_id];
+    int width = state_bound_fraction * count;
+
+    return StateBounds {
+        .lower = std::max(0, count - width),
+        .upper = count + width
+    };
+}
+
+PropensityBounds ReactionNetwork::compute_propensity_bounds(
+    std::vector<int> &lower_state,
+    std::vector<int> &upper_state,
+    int reaction_index) {
+
+    return PropensityBounds {
+        .lower = compute_propensity(lower_state, reaction_index),
+        .upper = compute_propensity(upper_state, reaction_index)
+    };
+}
+
+PartialPropensityTable &ReactionNetwork::get_partial_propensity_table() {
+
+    std::call_once(partial_propensity_table_flag, [&] {
+        PartialPropensityTable &table = partial_propensity_table;
+        int number_of_species = initial_state.size();
+        int number_of_reactions = reactions.size();
+
+        // number of reactions each species is a reactant of
+        std::vector<int> degrees (number_of_species, 0);
+        for (Reaction &reaction : reactions) {
+            for (int m = 0; m < reaction.number_of_reactants; m++) {
+                if (m == 1 && reaction.reactants[0] == reaction.reactants[1])
+                    break;
+
+                degrees[reaction.reactants[m]]++;
+            }
+        }
+
+        // a bimolecular reaction goes into the row of the reactant with
+        // the larger degree, so a hub species is almost never the one
+        // its partial propensities depend on. Reactions with zero
+        // reactants go into the extra row number_of_species.
+        std::vector<int> reaction_rows (number_of_reactions);
+        std::vector<int> reaction_dependencies (number_of_reactions, -1);
+        for (int j = 0; j < number_of_reactions; j++) {
+            Reaction &reaction = reactions[j];
+            if (reaction.number_of_reactants == 0)
+                reaction_rows[j] = number_of_species;
+
+            else if (reaction.number_of_reactants == 1)
+                reaction_rows[j] = reaction.reactants[0];
+
+            else {
+                int a = reaction.reactants[0];
+                int b = reaction.reactants[1];
+                if (degrees[b] > degrees[a]) std::swap(a, b);
+                reaction_rows[j] = a;
+                reaction_dependencies[j] = b;
+            }
+        }
+
+        // sort the entries by row, keeping the reaction order within
+        // a row
+        table.row_offsets.assign(number_of_species + 2, 0);
+        for (int j = 0; j < number_of_reactions; j++)
+            table.row_offsets[reaction_rows[j] + 1]++;
+
+        for (int i = 0; i <= number_of_species; i++)
+            table.row_offsets[i + 1] += table.row_offsets[i];
+
+        std::vector<int> reaction_entries (number_of_reactions);
+        std::vector<int> next_entries (
+            table.row_offsets.begin(),
+            table.row_offsets.end() - 1);
+
+        table.entry_reactions.resize(number_of_reactions);
+        table.entry_rows.resize(number_of_reactions);
+        for (int j = 0; j < number_of_reactions; j++) {
+            int entry = next_entries[reaction_rows[j]]++;
+            reaction_entries[j] = entry;
+            table.entry_reactions[entry] = j;
+            table.entry_rows[entry] = reaction_rows[j];
+        }
+
+        // same for the dependents of each species
+        table.dependent_offsets.assign(number_of_species + 1, 0);
+        for (int j = 0; j < number_of_reactions; j++)
+            if (reaction_dependencies[j] >= 0)
+                table.dependent_offsets[reaction_dependencies[j] + 1]++;
+
+        for (int i = 0; i < number_of_species; i++)
+            table.dependent_offsets[i + 1] += table.dependent_offsets[i];
+
+        next_entries.assign(
+            table.dependent_offsets.begin(),
+            table.dependent_offsets.end() - 1);
+
+        table.dependent_entries.resize(table.dependent_offsets.back());
+        for (int j = 0; j < number_of_reactions; j++)
+            if (reaction_dependencies[j] >= 0)
+                table.dependent_entries[next_entries[reaction_dependencies[j]]++] =
+                    reaction_entries[j];
+    });
+
+    return partial_propensity_table;
+}
+
+double ReactionNetwork::compute_partial_propensity(
+    std::vector<int> &state,
+    int reaction_index,
+    int row) {
+
+    Reaction &reaction = reactions[reaction_index];
+
+    // zero reactants
+    if (reaction.number_of_reactants == 0)
+        return factor_zero * reaction.rate;
+
+    // one reactant
+    else if (reaction.number_of_reactants == 1)
+        return reaction.rate;
+
+    // two reactants. A + A can't fire with fewer than 2 copies of A,
+    // and the partial propensity must not go negative when A runs out.
+    else if (reaction.reactants[0] == reaction.reactants[1])
+        return factor_duplicate
+            * factor_two
+            * std::max(state[row] - 1, 0)
+            * reaction.rate;
+
+    else {
+        int other = reaction.reactants[0] == row
+            ? reaction.reactants[1]
+            : reaction.reactants[0];
+
+        return factor_two * state[other] * reaction.rate;
+    }
+}
+
+std::vector<std::pair<int, int>> &ReactionNetwork::get_reversible_pairs() {
+
+    std::call_once(reversible_pairs_flag, [&] {
+        // reactants followed by products, each sorted and padded with -1
+        auto key = [&](int reaction_index, bool reversed) {
+            Reaction &reaction = reactions[reaction_index];
+            std::array<int, 4> result = {-1, -1, -1, -1};
+            int *left = &result[reversed ? 2 : 0];
+            int *right = &result[reversed ? 0 : 2];
+
+            for (int m = 0; m < reaction.number_of_reactants; m++)
+                left[m] = reaction.reactants[m];
+
+            for (int m = 0; m < reaction.number_of_products; m++)
+                right[m] = reaction.products[m];
+
+            if (left[0] < left[1]) std::swap(left[0], left[1]);
+            if (right[0] < right[1]) std::swap(right[0], right[1]);
+            return result;
+        };
+
+        std::vector<std::pair<std::array<int, 4>, int>> keys;
+        for (unsigned long int j = 0; j < reactions.size(); j++) {
+            int species[4];
+            int changes[4];
+            if (reactions[j].rate <= 0.0 ||
+                compute_net_changes(j, species, changes) == 0)
+                continue;
+
+            keys.push_back({key(j, false), j});
+        }
+
+        std::sort(keys.begin(), keys.end());
+
+        std::vector<bool> paired (reactions.size(), false);
+        for (auto &[forward_key, forward] : keys) {
+            if (paired[forward]) continue;
+
+            // the first unpaired reaction undoing forward
+            std::array<int, 4> reverse_key = key(forward, true);
+            auto it = std::lower_bound(
+                keys.begin(), keys.end(),
+                std::pair<std::array<int, 4>, int> {reverse_key, -1});
+
+            while (it != keys.end() && it->first == reverse_key && paired[it->second])
+                it++;
+
+            if (it == keys.end() || it->first != reverse_key) continue;
+
+            int reverse = it->second;
+            paired[forward] = true;
+            paired[reverse] = true;
+            reversible_pairs.push_back({
+                    std::min(forward, reverse),
+                    std::max(forward, reverse)});
+        }
+
+        std::sort(reversible_pairs.begin(), reversible_pairs.end());
+    });
+
+    return reversible_pairs;
+}
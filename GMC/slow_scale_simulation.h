@@ -0,0 +1,525 @@
+#pragma once
+#include <cmath>
+#include <limits>
+#include "reaction_network.h"
+#include "../core/firing_recorder.h"
+
+// slow scale SSA for fast reversible pairs, as described in
+// https://doi.org/10.1063/1.1824902
+//
+// Pairs of reactions which undo each other, like A + B <-> C, often
+// fire back and forth many times between two firings of reactions
+// which change anything else. If a pair fires at least fast_ratio
+// times as often as the reactions consuming its species, we treat it
+// as fast: its species relax to the quasi equilibrium distribution of
+// the extent of the pair (the number of times the forward reaction has
+// fired minus the reverse one) between slow firings. Along the extent,
+// the pair is a birth death process, so the distribution follows from
+// detailed balance and is computed up to a relative cutoff of
+// exp(-equilibrium_cutoff) around its mode.
+//
+// The slow reactions are sampled by the solver with their expected
+// propensities under the quasi equilibrium distribution. Mass action
+// propensities are linear in each reactant, so this is the propensity
+// at the mean counts, unless both reactants are in the same fast pair.
+// When a slow reaction fires, the pairs it consumes from are resampled
+// from the distribution conditioned on the reaction firing, and the
+// firings of the fast pair which get there are recorded before the
+// slow reaction, so replaying the leaps table stays consistent. Fast
+// pairs whose totals change get a new distribution, and are checked
+// against fast_ratio again. A pair which is no longer fast enough is
+// moved to an extent sampled from its distribution and simulated
+// exactly from then on.
+//
+// Pairs sharing a species are coupled. Coupled groups aren't handled
+// as a whole: only the fastest pair of such a group is treated as
+// fast, and the others are simulated exactly. Pairs are only made fast
+// when the simulation starts. This only samples the distribution
+// approximately, so it is never picked by --solver=auto. Firings are
+// recorded with a FiringRecorder. This works with ReactionNetwork
+// only. step counts the history elements, and the simulation stops
+// once more than step_cutoff reactions have fired.
+
+struct FastPair {
+    int forward;
+    int reverse;
+
+    // net changes of a forward firing
+    int number_of_species;
+    int species[4];
+    int changes[4];
+
+    // quasi equilibrium distribution of the extent. Extents are counted
+    // from the state the distribution was computed in, and
+    // probabilities[l] is the probability of extent lowest_extent + l.
+    int lowest_extent;
+    std::vector<double> probabilities;
+    int extent; // extent of the current state
+};
+
+template <typename Solver, typename Model>
+struct SlowScaleSimulation {
+    Model &model;
+    unsigned long int seed;
+    std::vector<int> state;
+
+    // state with the species of fast pairs replaced by their expected
+    // counts
+    std::vector<double> mean_state;
+    double time;
+    long int step; // number of history elements
+
+    std::vector<FastPair> pairs;
+    std::vector<int> species_pairs; // fast pair of each species, or -1
+    std::vector<int> reaction_pairs; // fast pair of each reaction, or -1
+
+    // scratch space for computing distributions
+    std::vector<double> upper_log_weights;
+    std::vector<double> lower_log_weights;
+    std::vector<double> weights;
+
+    // expected propensities of the slow reactions. Fast reactions are 0.
+    std::vector<double> propensities;
+    Solver solver; // samples slow reactions
+    Sampler sampler; // resamples fast pairs
+    History history;
+    FiringRecorder recorder;
+    std::vector<Update> update_buffer;
+    std::vector<int> changed_species;
+    std::vector<bool> species_changed;
+    std::vector<int> changed_pairs;
+    std::vector<bool> pair_changed;
+    std::vector<int> demoted_reactions;
+
+    static constexpr double fast_ratio = 100.0;
+    static constexpr double equilibrium_cutoff = 40.0;
+
+    // the resampling sampler needs a stream which is independent from
+    // the solver, which is seeded with seed.
+    static constexpr unsigned long int pair_seed_mask = 0x55a;
+
+    SlowScaleSimulation(Model &model,
+                        unsigned long int seed,
+
+                        // a step records many firings, so the history
+                        // length doesn't follow from the step cutoff
+                        long int) :
+        model (model),
+        seed (seed),
+        state (model.initial_state),
+        mean_state (state.begin(), state.end()),
+        time (0.0),
+        step (0),
+        species_pairs (state.size(), -1),
+        reaction_pairs (model.reactions.size(), -1),
+        propensities (compute_initial_partition()),
+        solver (seed, std::ref(propensities)),
+        sampler (seed, pair_seed_mask),
+        history (),
+        recorder (history, model.snapshot_interval, propensities.size()),
+        species_changed (state.size(), false),
+        pair_changed (pairs.size(), false) {};
+
+    template <typename State>
+    double shifted_propensity(
+        State &shifted_state,
+        FastPair &pair,
+        int extent,
+        int reaction_index);
+
+    void compute_equilibrium(FastPair &pair);
+    void update_means(FastPair &pair);
+    double pair_expectation(FastPair &pair, int reaction_index);
+    double expected_propensity(int reaction_index);
+    double fast_flux(FastPair &pair);
+    std::vector<double> compute_initial_partition();
+    void demote(int pair_index);
+    void resample(FastPair &pair, int reaction_index);
+    void update_propensities();
+    bool execute_step();
+    void execute_steps(long int step_cutoff);
+};
+
+
+// propensity of reaction_index with the species of pair moved by
+// extent forward firings
+template <typename Solver, typename Model>
+template <typename State>
+double SlowScaleSimulation<Solver, Model>::shifted_propensity(
+    State &shifted_state,
+    FastPair &pair,
+    int extent,
+    int reaction_index) {
+
+    for (int k = 0; k < pair.number_of_species; k++)
+        shifted_state[pair.species[k]] += pair.changes[k] * extent;
+
+    double propensity = model.compute_propensity(shifted_state, reaction_index);
+
+    for (int k = 0; k < pair.number_of_species; k++)
+        shifted_state[pair.species[k]] -= pair.changes[k] * extent;
+
+    return propensity;
+};
+
+template <typename Solver, typename Model>
+void SlowScaleSimulation<Solver, Model>::compute_equilibrium(FastPair &pair) {
+    // extents which keep the counts nonnegative
+    int lower_bound = std::numeric_limits<int>::min();
+    int upper_bound = std::numeric_limits<int>::max();
+    for (int k = 0; k < pair.number_of_species; k++) {
+        int count = state[pair.species[k]];
+        int change = pair.changes[k];
+        if (change > 0) lower_bound = std::max(lower_bound, - (count / change));
+        else upper_bound = std::min(upper_bound, count / - change);
+    }
+
+    // detailed balance: p(x + 1) / p(x) = a_forward(x) / a_reverse(x + 1)
+    double log_weight = 0.0;
+    double max_log_weight = 0.0;
+    upper_log_weights.clear();
+    for (int x = 0; x < upper_bound; x++) {
+        double forward = shifted_propensity(state, pair, x, pair.forward);
+        double reverse = shifted_propensity(state, pair, x + 1, pair.reverse);
+        if (forward <= 0.0 || reverse <= 0.0) break;
+
+        log_weight += std::log(forward) - std::log(reverse);
+        upper_log_weights.push_back(log_weight);
+        max_log_weight = std::max(max_log_weight, log_weight);
+        if (log_weight < max_log_weight - equilibrium_cutoff) break;
+    }
+
+    log_weight = 0.0;
+    lower_log_weights.clear();
+    for (int x = 0; x > lower_bound; x--) {
+        double forward = shifted_propensity(state, pair, x - 1, pair.forward);
+        double reverse = shifted_propensity(state, pair, x, pair.reverse);
+        if (forward <= 0.0 || reverse <= 0.0) break;
+
+        log_weight += std::log(reverse) - std::log(forward);
+        lower_log_weights.push_back(log_weight);
+        max_log_weight = std::max(max_log_weight, log_weight);
+        if (log_weight < max_log_weight - equilibrium_cutoff) break;
+    }
+
+    pair.extent = 0;
+    pair.lowest_extent = - (int) lower_log_weights.size();
+    pair.probabilities.clear();
+    for (auto it = lower_log_weights.rbegin(); it != lower_log_weights.rend(); it++)
+        pair.probabilities.push_back(std::exp(*it - max_log_weight));
+
+    pair.probabilities.push_back(std::exp(- max_log_weight));
+
+    for (double upper_log_weight : upper_log_weights)
+        pair.probabilities.push_back(std::exp(upper_log_weight - max_log_weight));
+
+    double sum = 0.0;
+    for (double probability : pair.probabilities) sum += probability;
+    for (double &probability : pair.probabilities) probability /= sum;
+};
+
+template <typename Solver, typename Model>
+void SlowScaleSimulation<Solver, Model>::update_means(FastPair &pair) {
+    double mean_extent = 0.0;
+    for (unsigned long int l = 0; l < pair.probabilities.size(); l++)
+        mean_extent += pair.probabilities[l] * (pair.lowest_extent + (int) l);
+
+    for (int k = 0; k < pair.number_of_species; k++)
+        mean_state[pair.species[k]] = state[pair.species[k]]
+            + pair.changes[k] * (mean_extent - pair.extent);
+};
+
+// expected propensity of reaction_index over the distribution of pair,
+// with the other fast pairs at their means
+template <typename Solver, typename Model>
+double SlowScaleSimulation<Solver, Model>::pair_expectation(
+    FastPair &pair,
+    int reaction_index) {
+
+    for (int k = 0; k < pair.number_of_species; k++)
+        mean_state[pair.species[k]] = state[pair.species[k]];
+
+    double expectation = 0.0;
+    for (unsigned long int l = 0; l < pair.probabilities.size(); l++)
+        expectation += pair.probabilities[l] * shifted_propensity(
+            mean_state,
+            pair,
+            pair.lowest_extent + (int) l - pair.extent,
+            reaction_index);
+
+    update_means(pair);
+    return expectation;
+};
+
+template <typename Solver, typename Model>
+double SlowScaleSimulation<Solver, Model>::expected_propensity(int reaction_index) {
+    Reaction &reaction = model.reactions[reaction_index];
+    if (reaction.number_of_reactants == 2) {
+        int pair_index = species_pairs[reaction.reactants[0]];
+        if (pair_index >= 0 && pair_index == species_pairs[reaction.reactants[1]])
+            return pair_expectation(pairs[pair_index], reaction_index);
+    }
+
+    // fast pairs are independent, so the propensity is linear in each
+    // of them
+    return model.compute_propensity(mean_state, reaction_index);
+};
+
+// equilibrium flux of pair, with its distribution computed in the
+// current state, if it fires at least fast_ratio times as often as the
+// reactions consuming its species, and 0 otherwise. Leaves the means of
+// the species of pair up to date.
+template <typename Solver, typename Model>
+double SlowScaleSimulation<Solver, Model>::fast_flux(FastPair &pair) {
+    double flux = pair_expectation(pair, pair.forward);
+
+    double slow_rate = 0.0;
+    for (int k = 0; k < pair.number_of_species; k++)
+        for (int j : model.get_state_dependents(pair.species[k]))
+            if (j != pair.forward && j != pair.reverse)
+                slow_rate += model.compute_propensity(state, j);
+
+    return flux >= fast_ratio * slow_rate ? flux : 0.0;
+};
+
+template <typename Solver, typename Model>
+std::vector<double> SlowScaleSimulation<Solver, Model>::compute_initial_partition() {
+    std::vector<FastPair> candidates;
+    std::vector<std::pair<double, int>> fluxes; // equilibrium flux, candidate
+
+    for (auto [forward, reverse] : model.get_reversible_pairs()) {
+        if (model.compute_propensity(state, forward) == 0.0 &&
+            model.compute_propensity(state, reverse) == 0.0)
+            continue;
+
+        FastPair pair;
+        pair.forward = forward;
+        pair.reverse = reverse;
+        pair.number_of_species = model.compute_net_changes(
+            forward, pair.species, pair.changes);
+
+        compute_equilibrium(pair);
+        double flux = fast_flux(pair);
+        for (int k = 0; k < pair.number_of_species; k++)
+            mean_state[pair.species[k]] = state[pair.species[k]];
+
+        if (flux > 0.0) {
+            fluxes.push_back({flux, candidates.size()});
+            candidates.push_back(std::move(pair));
+        }
+    }
+
+    // fastest pairs first, skipping pairs coupled to a faster one
+    std::sort(fluxes.begin(), fluxes.end(), std::greater<>());
+    for (auto [flux, candidate] : fluxes) {
+        FastPair &pair = candidates[candidate];
+
+        bool coupled = false;
+        for (int k = 0; k < pair.number_of_species; k++)
+            if (species_pairs[pair.species[k]] >= 0) coupled = true;
+
+        if (coupled) continue;
+
+        int pair_index = pairs.size();
+        for (int k = 0; k < pair.number_of_species; k++)
+            species_pairs[pair.species[k]] = pair_index;
+
+        reaction_pairs[pair.forward] = pair_index;
+        reaction_pairs[pair.reverse] = pair_index;
+        pairs.push_back(std::move(pair));
+    }
+
+    for (FastPair &pair : pairs) update_means(pair);
+
+    std::vector<double> initial_propensities (model.reactions.size());
+    for (unsigned long int j = 0; j < model.reactions.size(); j++)
+        initial_propensities[j] = reaction_pairs[j] >= 0
+            ? 0.0
+            : expected_propensity(j);
+
+    return initial_propensities;
+};
+
+// move pair to an extent sampled from its distribution conditioned on
+// reaction_index firing, or from its distribution if reaction_index is
+// -1, and record the fast firings which get there
+template <typename Solver, typename Model>
+void SlowScaleSimulation<Solver, Model>::resample(
+    FastPair &pair,
+    int reaction_index) {
+
+    for (int k = 0; k < pair.number_of_species; k++)
+        mean_state[pair.species[k]] = state[pair.species[k]];
+
+    weights.resize(pair.probabilities.size());
+    double sum = 0.0;
+    for (unsigned long int l = 0; l < pair.probabilities.size(); l++) {
+        weights[l] = pair.probabilities[l];
+        if (reaction_index >= 0)
+            weights[l] *= shifted_propensity(
+                mean_state,
+                pair,
+                pair.lowest_extent + (int) l - pair.extent,
+                reaction_index);
+
+        sum += weights[l];
+    }
+
+    update_means(pair);
+    if (sum == 0.0) return;
+
+    // rounding can push fraction past the last nonzero weight, so we
+    // only ever pick an extent with nonzero weight.
+    double fraction = sampler.generate() * sum;
+    double partial = 0.0;
+    int chosen = 0;
+    for (unsigned long int l = 0; l < weights.size(); l++) {
+        if (weights[l] == 0.0) continue;
+
+        chosen = l;
+        partial += weights[l];
+        if (partial > fraction) break;
+    }
+
+    int extent = pair.lowest_extent + chosen;
+    int difference = extent - pair.extent;
+    if (difference == 0) return;
+
+    if (difference > 0) recorder.record(pair.forward, difference, time);
+    else recorder.record(pair.reverse, - difference, time);
+
+    for (int k = 0; k < pair.number_of_species; k++)
+        state[pair.species[k]] += pair.changes[k] * difference;
+
+    pair.extent = extent;
+};
+
+// simulate the reactions of a pair exactly from now on. The species
+// are in equilibrium, so the pair is first moved to an extent sampled
+// from its distribution.
+template <typename Solver, typename Model>
+void SlowScaleSimulation<Solver, Model>::demote(int pair_index) {
+    FastPair &pair = pairs[pair_index];
+    resample(pair, -1);
+
+    for (int k = 0; k < pair.number_of_species; k++) {
+        species_pairs[pair.species[k]] = -1;
+        mean_state[pair.species[k]] = state[pair.species[k]];
+    }
+
+    reaction_pairs[pair.forward] = -1;
+    reaction_pairs[pair.reverse] = -1;
+    demoted_reactions.push_back(pair.forward);
+    demoted_reactions.push_back(pair.reverse);
+};
+
+// recompute the distributions of the fast pairs and the expected
+// propensities depending on the species in changed_species
+template <typename Solver, typename Model>
+void SlowScaleSimulation<Solver, Model>::update_propensities() {
+    for (int i : changed_species) {
+        int pair_index = species_pairs[i];
+        if (pair_index < 0) mean_state[i] = state[i];
+        else if (! pair_changed[pair_index]) {
+            pair_changed[pair_index] = true;
+            changed_pairs.push_back(pair_index);
+        }
+    }
+
+    for (int pair_index : changed_pairs) {
+        pair_changed[pair_index] = false;
+        FastPair &pair = pairs[pair_index];
+        compute_equilibrium(pair);
+        if (fast_flux(pair) == 0.0) demote(pair_index);
+
+        // the mean of every species of the pair has changed
+        for (int k = 0; k < pair.number_of_species; k++)
+            if (! species_changed[pair.species[k]]) {
+                species_changed[pair.species[k]] = true;
+                changed_species.push_back(pair.species[k]);
+            }
+    }
+
+    for (int i : changed_species) {
+        species_changed[i] = false;
+        for (int j : model.get_state_dependents(i)) {
+            if (reaction_pairs[j] >= 0) continue;
+
+            propensities[j] = expected_propensity(j);
+            update_buffer.push_back(Update {
+                    .index = (unsigned long int) j,
+                    .propensity = propensities[j]});
+        }
+    }
+
+    // the solver holds zero for the reactions of a fast pair, so a
+    // demoted pair needs its exact propensities. The loop above only
+    // reaches reactions through their reactants, which misses a pair
+    // reaction without reactants, so every demoted reaction is
+    // recomputed here.
+    for (int j : demoted_reactions) {
+        propensities[j] = expected_propensity(j);
+        update_buffer.push_back(Update {
+                .index = (unsigned long int) j,
+                .propensity = propensities[j]});
+    }
+
+    demoted_reactions.clear();
+    changed_species.clear();
+    changed_pairs.clear();
+    solver.update(update_buffer);
+    update_buffer.clear();
+};
+
+template <typename Solver, typename Model>
+bool SlowScaleSimulation<Solver, Model>::execute_step() {
+    std::optional<Event> maybe_event = solver.event();
+    if (! maybe_event) return false;
+
+    Event event = maybe_event.value();
+    int next_reaction = event.index;
+    time += event.dt;
+    recorder.advance(time);
+
+    Reaction &reaction = model.reactions[next_reaction];
+    for (int m = 0; m < reaction.number_of_reactants; m++) {
+        int pair_index = species_pairs[reaction.reactants[m]];
+        if (pair_index < 0) continue;
+
+        // both reactants in the same pair are resampled together
+        if (m == 1 && pair_index == species_pairs[reaction.reactants[0]])
+            break;
+
+        resample(pairs[pair_index], next_reaction);
+    }
+
+    recorder.record(next_reaction, 1, time);
+
+    int species[4];
+    int changes[4];
+    int number_of_changes = model.compute_net_changes(
+        next_reaction, species, changes);
+
+    for (int k = 0; k < number_of_changes; k++) {
+        state[species[k]] += changes[k];
+        if (! species_changed[species[k]]) {
+            species_changed[species[k]] = true;
+            changed_species.push_back(species[k]);
+        }
+    }
+
+    update_propensities();
+    step = history.size();
+    return true;
+};
+
+template <typename Solver, typename Model>
+void SlowScaleSimulation<Solver, Model>::execute_steps(long int step_cutoff) {
+    while(execute_step()) {
+        if (recorder.number_of_firings > step_cutoff)
+            break;
+    }
+
+    recorder.finish(time);
+    step = history.size();
+};
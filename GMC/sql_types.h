@@ -64,7 +64,7 @@ void InitialStateSql::action(InitialStateSql &r, sqlite3_stmt *stmt) {
 
 struct TrajectoriesSql {
     int seed;
-    int step;
+    long int step;
     int reaction_id;
     double time;
     static std::string sql_statement;
@@ -76,7 +76,7 @@ std::string TrajectoriesSql::sql_statement =
 
 void TrajectoriesSql::action (TrajectoriesSql& t, sqlite3_stmt* stmt) {
     sqlite3_bind_int(stmt, 1, t.seed);
-    sqlite3_bind_int(stmt, 2, t.step);
+    sqlite3_bind_int64(stmt, 2, t.step);
     sqlite3_bind_int(stmt, 3, t.reaction_id);
     sqlite3_bind_double(stmt, 4, t.time);
 };
@@ -0,0 +1,327 @@
+#pragma once
+#include <cmath>
+#include <limits>
+#include "reaction_network.h"
+#include "../core/firing_recorder.h"
+
+// adaptive explicit tau leaping, with the step size selection and
+// critical reactions of Cao, Gillespie and Petzold:
+// https://doi.org/10.1063/1.2159468
+//
+// A leap fires each noncritical reaction a Poisson distributed number
+// of times, with mean propensity * tau, where tau is chosen so that
+// the expected relative change of every reactant count is at most
+// epsilon. Reactions which are within critical_threshold firings of
+// exhausting one of their reactants are critical, and at most one of
+// them fires per leap, as in the SSA. If tau would be smaller than a
+// few expected SSA steps, we take exact_step_count exact steps with
+// the solver instead. Leaps which drive a count negative are retried
+// with half the step size.
+//
+// This only samples the distribution approximately, so it is never
+// picked by --solver=auto. The firings of a leap are recorded with a
+// FiringRecorder, and the dispatcher writes one row of the leaps table
+// per reaction with the time of the end of the leap and the number of
+// times it fired. Exact steps are recorded the same way, with a count
+// of 1, so the whole trajectory is in the leaps table. If
+// snapshot_interval is positive, leaps are cut at multiples of
+// snapshot_interval.
+//
+// This works with ReactionNetwork only, since it needs the
+// stoichiometry of the reactions. step counts the history elements,
+// and the simulation stops once more than step_cutoff reactions have
+// fired.
+
+template <typename Solver, typename Model>
+struct TauLeapingSimulation {
+    Model &model;
+    unsigned long int seed;
+    std::vector<int> state;
+    double time;
+    long int step; // number of history elements
+
+    // the solver is only used for the exact steps, but we keep its
+    // propensities up to date during leaps as well.
+    std::vector<double> propensities;
+    Solver solver;
+    Sampler sampler; // poisson variates and critical reactions
+    History history;
+    FiringRecorder recorder;
+    std::vector<Update> update_buffer;
+
+    // highest order of the reactions each species is a reactant of,
+    // and whether that order needs two copies of the species.
+    std::vector<int> highest_orders;
+    std::vector<bool> needs_two;
+
+    // scratch space for a single leap
+    std::vector<double> means;
+    std::vector<double> variances;
+    std::vector<bool> critical;
+    std::vector<std::pair<int, int>> leap_firings; // reaction, count
+    std::vector<int> changed_species;
+    std::vector<bool> species_changed;
+
+    int exact_steps_remaining;
+
+    static constexpr int critical_threshold = 10;
+    static constexpr double exact_threshold = 10.0;
+    static constexpr int exact_step_count = 100;
+
+    // the leap sampler needs a stream which is independent from the
+    // solver, which is seeded with seed.
+    static constexpr unsigned long int leap_seed_mask = 0x7a71ea9;
+
+    TauLeapingSimulation(Model &model,
+                         unsigned long int seed,
+
+                         // a leap records many firings, so the history
+                         // length doesn't follow from the step cutoff
+                         long int) :
+        model (model),
+        seed (seed),
+        state (model.initial_state),
+        time (0.0),
+        step (0),
+        propensities (model.initial_propensities),
+        solver (seed, std::ref(propensities)),
+        sampler (seed, leap_seed_mask),
+        history (),
+        recorder (history, model.snapshot_interval, propensities.size()),
+        highest_orders (state.size(), 0),
+        needs_two (state.size(), false),
+        means (state.size()),
+        variances (state.size()),
+        critical (propensities.size(), false),
+        species_changed (state.size(), false),
+        exact_steps_remaining (0) {
+            for (Reaction &reaction : model.reactions) {
+                int order = reaction.number_of_reactants;
+                for (int m = 0; m < order; m++) {
+                    int i = reaction.reactants[m];
+                    bool two = order == 2 &&
+                        reaction.reactants[0] == reaction.reactants[1];
+
+                    if (order > highest_orders[i]) {
+                        highest_orders[i] = order;
+                        needs_two[i] = two;
+                    } else if (order == highest_orders[i] && two) {
+                        needs_two[i] = true;
+                    }
+                }
+            }
+        };
+
+    double noncritical_tau();
+    void update_propensities();
+    bool execute_exact_step();
+    bool execute_leap();
+    bool execute_step();
+    void execute_steps(long int step_cutoff);
+};
+
+
+template <typename Solver, typename Model>
+double TauLeapingSimulation<Solver, Model>::noncritical_tau() {
+    std::fill(means.begin(), means.end(), 0.0);
+    std::fill(variances.begin(), variances.end(), 0.0);
+
+    int species[4];
+    int changes[4];
+    for (unsigned long int j = 0; j < propensities.size(); j++) {
+        if (propensities[j] == 0.0 || critical[j]) continue;
+
+        int count = model.compute_net_changes(j, species, changes);
+        for (int k = 0; k < count; k++) {
+            means[species[k]] += changes[k] * propensities[j];
+            variances[species[k]] += changes[k] * changes[k] * propensities[j];
+        }
+    }
+
+    double tau = std::numeric_limits<double>::infinity();
+    for (unsigned long int i = 0; i < state.size(); i++) {
+        if (highest_orders[i] == 0 || variances[i] == 0.0) continue;
+
+        double g = highest_orders[i];
+        if (needs_two[i] && state[i] > 1) g += 1.0 / (state[i] - 1);
+
+        double bound = std::max(model.tau_epsilon * state[i] / g, 1.0);
+        if (means[i] != 0.0)
+            tau = std::min(tau, bound / std::abs(means[i]));
+
+        tau = std::min(tau, bound * bound / variances[i]);
+    }
+
+    return tau;
+};
+
+// recompute the propensities depending on the species in changed_species
+template <typename Solver, typename Model>
+void TauLeapingSimulation<Solver, Model>::update_propensities() {
+    for (int i : changed_species) {
+        species_changed[i] = false;
+        for (int j : model.get_state_dependents(i)) {
+            propensities[j] = model.compute_propensity(state, j);
+            update_buffer.push_back(Update {
+                    .index = (unsigned long int) j,
+                    .propensity = propensities[j]});
+        }
+    }
+
+    changed_species.clear();
+    solver.update(update_buffer);
+    update_buffer.clear();
+};
+
+template <typename Solver, typename Model>
+bool TauLeapingSimulation<Solver, Model>::execute_exact_step() {
+    std::optional<Event> maybe_event = solver.event();
+    if (! maybe_event) return false;
+
+    Event event = maybe_event.value();
+    int next_reaction = event.index;
+    time += event.dt;
+
+    recorder.advance(time);
+    recorder.record(next_reaction, 1, time);
+    model.update_state(std::ref(state), next_reaction);
+    model.update_propensities(
+        [&] (Update update) {
+            propensities[update.index] = update.propensity;
+            update_buffer.push_back(update);
+        },
+        std::ref(state),
+        next_reaction);
+
+    solver.update(update_buffer);
+    update_buffer.clear();
+
+    return true;
+};
+
+template <typename Solver, typename Model>
+bool TauLeapingSimulation<Solver, Model>::execute_leap() {
+    double propensity_sum = 0.0;
+    double critical_sum = 0.0;
+    for (unsigned long int j = 0; j < propensities.size(); j++) {
+        if (propensities[j] == 0.0) continue;
+
+        propensity_sum += propensities[j];
+        critical[j] = model.compute_max_firings(state, j) < critical_threshold;
+        if (critical[j]) critical_sum += propensities[j];
+    }
+
+    if (propensity_sum == 0.0) return false;
+
+    double tau_noncritical = noncritical_tau();
+    if (tau_noncritical < exact_threshold / propensity_sum) {
+        exact_steps_remaining = exact_step_count - 1;
+        return execute_exact_step();
+    }
+
+    recorder.advance(time);
+
+    int species[4];
+    int changes[4];
+    bool at_snapshot = false;
+    while (true) {
+        double tau_critical = std::numeric_limits<double>::infinity();
+        if (critical_sum > 0.0)
+            tau_critical = sampler.exponential() / critical_sum;
+
+        double tau = std::min(tau_noncritical, tau_critical);
+        bool fire_critical = tau_critical <= tau_noncritical;
+
+        at_snapshot = false;
+        if (recorder.snapshots() && time + tau >= recorder.next_snapshot) {
+            tau = recorder.next_snapshot - time;
+            fire_critical = false;
+            at_snapshot = true;
+        }
+
+        leap_firings.clear();
+        for (unsigned long int j = 0; j < propensities.size(); j++) {
+            if (propensities[j] == 0.0 || critical[j]) continue;
+
+            int count = sampler.poisson(propensities[j] * tau);
+            if (count > 0) leap_firings.push_back({(int) j, count});
+        }
+
+        if (fire_critical) {
+            double fraction = sampler.generate() * critical_sum;
+            double partial = 0.0;
+            int last_critical = -1;
+            for (unsigned long int j = 0; j < propensities.size(); j++) {
+                if (propensities[j] == 0.0 || ! critical[j]) continue;
+
+                last_critical = j;
+                partial += propensities[j];
+                if (partial > fraction) break;
+            }
+
+            leap_firings.push_back({last_critical, 1});
+        }
+
+        // apply the leap and check for negative counts
+        for (auto [j, count] : leap_firings) {
+            int number_of_changes = model.compute_net_changes(j, species, changes);
+            for (int k = 0; k < number_of_changes; k++) {
+                state[species[k]] += changes[k] * count;
+                if (! species_changed[species[k]]) {
+                    species_changed[species[k]] = true;
+                    changed_species.push_back(species[k]);
+                }
+            }
+        }
+
+        bool negative = false;
+        for (int i : changed_species)
+            if (state[i] < 0) negative = true;
+
+        if (! negative) {
+            time = at_snapshot ? recorder.next_snapshot : time + tau;
+            break;
+        }
+
+        // undo the leap and try again with a smaller step
+        for (auto [j, count] : leap_firings) {
+            int number_of_changes = model.compute_net_changes(j, species, changes);
+            for (int k = 0; k < number_of_changes; k++)
+                state[species[k]] -= changes[k] * count;
+        }
+
+        for (int i : changed_species) species_changed[i] = false;
+        changed_species.clear();
+        tau_noncritical /= 2.0;
+    }
+
+    for (auto [j, count] : leap_firings) recorder.record(j, count, time);
+
+    update_propensities();
+    return true;
+};
+
+template <typename Solver, typename Model>
+bool TauLeapingSimulation<Solver, Model>::execute_step() {
+    bool result;
+    if (exact_steps_remaining > 0) {
+        exact_steps_remaining--;
+        result = execute_exact_step();
+    } else {
+        result = execute_leap();
+    }
+
+    step = history.size();
+    return result;
+};
+
+template <typename Solver, typename Model>
+void TauLeapingSimulation<Solver, Model>::execute_steps(long int step_cutoff) {
+    while(execute_step()) {
+        if (recorder.number_of_firings > step_cutoff)
+            break;
+    }
+
+    recorder.finish(time);
+    step = history.size();
+};
@@ -1,8 +1,19 @@
 #include <getopt.h>
-#include "../core/dispatcher.h"
+#include "../core/solver_registry.h"
 #include "sql_types.h"
 #include "nano_particle.h"
 
+// a nonzero propensity is the rate of the reaction times a constant
+// factor, so there are only as many distinct propensities as there are
+// distinct rates, which is what the equal rate solver needs.
+template <>
+struct ModelSolvers<NanoParticle> {
+    template <typename F>
+    static void for_each(F f) {
+        f("equal_rate", SolverEntry<EqualRateSolver>());
+    };
+};
+
 void print_usage() {
     std::cout << "Usage: specify the following options\n"
               << "--nano_particle_database\n"
@@ -10,11 +21,15 @@ void print_usage() {
               << "--number_of_simulations\n"
               << "--base_seed\n"
               << "--thread_count\n"
-              << "--step_cutoff\n";
+              << "--step_cutoff\n"
+              << "--solver (optional, default linear): "
+              << solver_names<NanoParticle>() << "\n"
+              << "--stop (optional): condition for stopping a trajectory early\n";
 }
 
 int main(int argc, char **argv) {
-    if (argc != 7) {
+    // --solver and --stop are optional
+    if (argc < 7 || argc > 9) {
         print_usage();
         exit(EXIT_FAILURE);
     }
@@ -27,10 +42,17 @@ int main(int argc, char **argv) {
         {"base_seed", required_argument, NULL, 4},
         {"thread_count", required_argument, NULL, 5},
         {"step_cutoff", required_argument, NULL, 6},
+        {"solver", required_argument, NULL, 7},
+        {"stop", required_argument, NULL, 8},
         {NULL, 0, NULL, 0}
         // last element of options array needs to be filled with zeros
     };
 
+    // options 1 to 6 are required. The argument count alone can't tell
+    // whether one of them was left out in favor of an optional one.
+    constexpr int number_of_required_options = 6;
+    bool seen[number_of_required_options + 1] = {};
+
     int c;
     int option_index = 0;
 
@@ -39,13 +61,18 @@ int main(int argc, char **argv) {
     int number_of_simulations = 0;
     int base_seed = 0;
     int thread_count = 0;
-    int step_cutoff = 0;
+    long int step_cutoff = 0;
+    std::string solver = "linear";
+    std::string stop = "";
 
     while ((c = getopt_long_only(
                 argc, argv, "",
                 long_options,
                 &option_index)) != -1) {
 
+        if (c >= 1 && c <= number_of_required_options)
+            seen[c] = true;
+
         switch (c) {
 
         case 1:
@@ -69,7 +96,15 @@ int main(int argc, char **argv) {
             break;
 
         case 6:
-            step_cutoff = atoi(optarg);
+            step_cutoff = atol(optarg);
+            break;
+
+        case 7:
+            solver = optarg;
+            break;
+
+        case 8:
+            stop = optarg;
             break;
 
         default:
@@ -81,26 +116,45 @@ int main(int argc, char **argv) {
         }
 
     }
+
+    for (int i = 1; i <= number_of_required_options; i++) {
+        if (! seen[i]) {
+            print_usage();
+            exit(EXIT_FAILURE);
+        }
+    }
+
     NanoParticleParameters parameters = {};
 
-    Dispatcher<
-        LinearSolver,
+    std::optional<StoppingCondition> stopping_condition =
+        stop.empty() ? StoppingCondition () : StoppingCondition::parse(stop);
+
+    if (! stopping_condition) {
+        print_usage();
+        exit(EXIT_FAILURE);
+    }
+
+    bool found = run_dispatcher<
         NanoParticle,
         NanoParticleParameters,
         TrajectoriesSql
-        >
-
-        dispatcher (
+        > (
+            solver,
             nano_particle_database,
             initial_state_database,
             number_of_simulations,
             base_seed,
             thread_count,
             step_cutoff,
-            parameters
+            parameters,
+            stopping_condition.value()
             );
 
-    dispatcher.run_dispatcher();
+    if (! found) {
+        print_usage();
+        exit(EXIT_FAILURE);
+    }
+
     exit(EXIT_SUCCESS);
 
 }
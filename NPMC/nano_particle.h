@@ -1,6 +1,7 @@
 #pragma once
 #include "../core/sql.h"
 #include "../core/simulation.h"
+#include "../core/rejection_simulation.h"
 #include "sql_types.h"
 #include <vector>
 #include <cmath>
@@ -81,6 +82,10 @@ struct NanoParticle {
 
     std::function<double(double)> distance_factor_function;
 
+    // sum of the upper bounds from compute_propensity_bounds, which
+    // bounds the propensity sum in every state
+    double propensity_sum_bound;
+
     // constructor
     NanoParticle(
         SqlConnection &nano_particle_database,
@@ -104,10 +109,13 @@ struct NanoParticle {
     // feels akward). The way around this is that the model class computes
     // all the propensity updates required, and then passes them into an
     // update_function lambda which is generated by the Simulation class from
-    // core.
+    // core. The lambda type is a template parameter rather than a
+    // std::function, so that the solver update gets inlined into the
+    // loop over dependents.
 
+    template <typename UpdateFunction>
     void update_propensities(
-        std::function<void(Update update)> update_function,
+        UpdateFunction &&update_function,
         std::vector<int> &state,
         int next_reaction_id
         );
@@ -116,10 +124,30 @@ struct NanoParticle {
     // to a SQL type.
     TrajectoriesSql history_element_to_sql(
         int seed,
-        int step,
+        long int step,
         HistoryElement history_element);
 
+    // rejection simulation interface. See core/rejection_simulation.h
+    // a propensity is either zero or the rate of the reaction times
+    // the factor for its number of sites, so 0 and that product bound
+    // it in every state. The interval of a site is all of its states,
+    // which it never leaves, so the bounds are computed once and never
+    // updated, and the cost of a step is in the rejected candidates.
+    // changed_state_entries is also used by the stopping monitor.
+    int changed_state_entries(
+        int reaction_id,
+        int changed_state[4]);
+
+    std::vector<int> &get_state_dependents(int site_id);
 
+    StateBounds compute_state_bounds(
+        std::vector<int> &state,
+        int site_id);
+
+    PropensityBounds compute_propensity_bounds(
+        std::vector<int> &lower_state,
+        std::vector<int> &upper_state,
+        int reaction_id);
 
 };
 
@@ -253,6 +281,12 @@ NanoParticle::NanoParticle(
         initial_propensities[reaction_id] = compute_propensity(std::ref(initial_state), reaction_id);
     }
 
+    propensity_sum_bound = 0.0;
+    for (unsigned int reaction_id = 0; reaction_id < reactions.size(); reaction_id++) {
+        propensity_sum_bound += compute_propensity_bounds(
+            initial_state, initial_state, reaction_id).upper;
+    }
+
 }
 
 void NanoParticle::compute_reactions() {
@@ -386,8 +420,9 @@ void NanoParticle::update_state(
 }
 
 
+template <typename UpdateFunction>
 void NanoParticle::update_propensities(
-    std::function<void(Update update)> update_function,
+    UpdateFunction &&update_function,
     std::vector<int> &state,
     int next_reaction_id
     ) {
@@ -400,6 +435,14 @@ void NanoParticle::update_propensities(
               i < site_reaction_dependency[reaction.site_id[k]].size();
               i++ ) {
             int reaction_id = site_reaction_dependency[reaction.site_id[k]][i];
+
+            // reactions between the two sites are in both dependency
+            // lists, so we only recompute them for the first site.
+            if (k == 1 &&
+                (reactions[reaction_id].site_id[0] == reaction.site_id[0] ||
+                 reactions[reaction_id].site_id[1] == reaction.site_id[0]))
+                continue;
+
             double new_propensity = compute_propensity(std::ref(state), reaction_id);
 
 
@@ -413,7 +456,7 @@ void NanoParticle::update_propensities(
 
 TrajectoriesSql NanoParticle::history_element_to_sql(
     int seed,
-    int step,
+    long int step,
     HistoryElement history_element) {
 
     Reaction reaction = reactions[history_element.reaction_id];
@@ -427,3 +470,47 @@ TrajectoriesSql NanoParticle::history_element_to_sql(
     };
 }
 
+
+int NanoParticle::changed_state_entries(
+    int reaction_id,
+    int changed_state[4]) {
+
+    Reaction &reaction = reactions[reaction_id];
+    Interaction &interaction = interactions[reaction.interaction_id];
+
+    for (int k = 0; k < interaction.number_of_sites; k++)
+        changed_state[k] = reaction.site_id[k];
+
+    return interaction.number_of_sites;
+}
+
+std::vector<int> &NanoParticle::get_state_dependents(int site_id) {
+    return site_reaction_dependency[site_id];
+}
+
+StateBounds NanoParticle::compute_state_bounds(
+    std::vector<int> &,
+    int site_id) {
+
+    return StateBounds {
+        .lower = 0,
+        .upper = degrees_of_freedom[sites[site_id].species_id] - 1
+    };
+}
+
+PropensityBounds NanoParticle::compute_propensity_bounds(
+    std::vector<int> &,
+    std::vector<int> &,
+    int reaction_id) {
+
+    Reaction &reaction = reactions[reaction_id];
+    Interaction &interaction = interactions[reaction.interaction_id];
+
+    double factor = interaction.number_of_sites == 1 ?
+        one_site_interaction_factor : two_site_interaction_factor;
+
+    return PropensityBounds {
+        .lower = 0.0,
+        .upper = reaction.rate * factor
+    };
+}
@@ -139,7 +139,7 @@ void InitialStateSql::action(InitialStateSql &r, sqlite3_stmt *stmt) {
 
 struct TrajectoriesSql {
     int seed;
-    int step;
+    long int step;
     double time;
     int site_id_1;
     int site_id_2;
@@ -153,7 +153,7 @@ std::string TrajectoriesSql::sql_statement =
 
 void TrajectoriesSql::action(TrajectoriesSql &r, sqlite3_stmt *stmt) {
     sqlite3_bind_int(stmt, 1, r.seed);
-    sqlite3_bind_int(stmt, 2, r.step);
+    sqlite3_bind_int64(stmt, 2, r.step);
     sqlite3_bind_double(stmt, 3, r.time);
     sqlite3_bind_int(stmt, 4, r.site_id_1);
     sqlite3_bind_int(stmt, 5, r.site_id_2);
@@ -8,3 +8,11 @@ echo "building GMC"
 $CC $flags ./GMC/GMC.cpp -o ./build/GMC
 echo "building NPMC"
 $CC $flags ./NPMC/NPMC.cpp -o ./build/NPMC
+
+# the reference trajectories in test_materials were generated with the
+# GSL sampler, so test.sh runs these builds
+mkdir -p build/gsl
+echo "building GMC with the GSL sampler"
+$CC $flags -DRNMC_GSL_SAMPLER ./GMC/GMC.cpp -o ./build/gsl/GMC
+echo "building NPMC with the GSL sampler"
+$CC $flags -DRNMC_GSL_SAMPLER ./NPMC/NPMC.cpp -o ./build/gsl/NPMC
@@ -1,55 +1,203 @@
 #pragma once
 #include <mutex>
 #include <thread>
+#include <optional>
+#include <type_traits>
 #include "sql.h"
 #include "simulation.h"
 #include "queues.h"
 
+// a chunk of a trajectory. The chunks of a trajectory arrive in
+// order, and the last one has finished set.
 struct HistoryPacket {
     std::vector<HistoryElement> history;
     unsigned long int seed;
+    long int first_step; // step of the first firing in history
+    bool finished;
+
+    // first passage of the stopping condition, set on the last chunk
+    bool stopped = false;
+    double first_passage_time = 0.0;
+    int alternative = 0;
+};
+
+struct FirstPassageSql {
+    int seed;
+    double time;
+    int condition;
+    static std::string sql_statement;
+    static void action(FirstPassageSql &r, sqlite3_stmt *stmt);
 };
 
+std::string FirstPassageSql::sql_statement =
+    "INSERT INTO first_passage VALUES (?1,?2,?3);";
+
+void FirstPassageSql::action(FirstPassageSql &r, sqlite3_stmt *stmt) {
+    sqlite3_bind_int(stmt, 1, r.seed);
+    sqlite3_bind_double(stmt, 2, r.time);
+    sqlite3_bind_int(stmt, 3, r.condition);
+}
+
+// approximate simulations record many firings of a reaction in a
+// single history element. Their whole history, including elements
+// with a single firing, is written to the leaps table, one row per
+// element, where step is the step of the first firing, so the next row
+// of the trajectory has step + count as its step.
+struct LeapsSql {
+    int seed;
+    long int step;
+    int reaction_id;
+    int count;
+    double time;
+    static std::string sql_statement;
+    static void action(LeapsSql &r, sqlite3_stmt *stmt);
+};
 
+std::string LeapsSql::sql_statement =
+    "INSERT INTO leaps VALUES (?1,?2,?3,?4,?5);";
+
+void LeapsSql::action(LeapsSql &r, sqlite3_stmt *stmt) {
+    sqlite3_bind_int(stmt, 1, r.seed);
+    sqlite3_bind_int64(stmt, 2, r.step);
+    sqlite3_bind_int(stmt, 3, r.reaction_id);
+    sqlite3_bind_int(stmt, 4, r.count);
+    sqlite3_bind_double(stmt, 5, r.time);
+}
+
+
+
+// SimulationType is the engine which runs a single trajectory. It is
+// constructed from (model, seed, step_cutoff) and needs to provide
+// execute_steps, step and a History called history like Simulation
+// does. If it also provides reset(seed), each thread builds a single
+// simulation and resets it between seeds. Stopping conditions are only
+// supported by simulations with a StoppingMonitor called stopping.
+// Simulations with a FiringRecorder called recorder write their
+// history to the leaps table instead of the trajectories table.
+template <typename SimulationType, typename = void>
+struct is_resettable_simulation : std::false_type {};
+
+template <typename SimulationType>
+struct is_resettable_simulation<
+    SimulationType,
+    std::void_t<decltype(std::declval<SimulationType &>().reset(0ul))>>
+    : std::true_type {};
+
+template <typename SimulationType, typename = void>
+struct has_stopping_monitor : std::false_type {};
+
+template <typename SimulationType>
+struct has_stopping_monitor<
+    SimulationType,
+    std::void_t<decltype(std::declval<SimulationType &>().stopping)>>
+    : std::true_type {};
+
+template <typename SimulationType, typename = void>
+struct records_leaps : std::false_type {};
+
+template <typename SimulationType>
+struct records_leaps<
+    SimulationType,
+    std::void_t<decltype(std::declval<SimulationType &>().recorder)>>
+    : std::true_type {};
 
-template <typename Solver, typename Model>
+template <
+    typename Solver,
+    typename Model,
+    template <typename, typename> class SimulationType = Simulation>
 struct SimulatorPayload {
     Model &model;
     HistoryQueue<HistoryPacket> &history_queue;
     SeedQueue &seed_queue;
-    int step_cutoff;
+    BufferPool<HistoryElement> &buffer_pool;
+    StoppingCondition *stopping_condition; // null if there is none
+    long int step_cutoff;
 
     SimulatorPayload(
         Model &model,
         HistoryQueue<HistoryPacket> &history_queue,
         SeedQueue &seed_queue,
-        int step_cutoff
+        BufferPool<HistoryElement> &buffer_pool,
+        StoppingCondition *stopping_condition,
+        long int step_cutoff
         ) :
 
             model (model),
             history_queue (history_queue),
             seed_queue (seed_queue),
+            buffer_pool (buffer_pool),
+            stopping_condition (stopping_condition),
             step_cutoff (step_cutoff) {};
 
     void run_simulator() {
+        using Simulation = SimulationType<Solver, Model>;
+        std::optional<Simulation> simulation;
+        unsigned long int seed;
 
         while (std::optional<unsigned long int> maybe_seed =
                seed_queue.get_seed()) {
 
-            unsigned long int seed = maybe_seed.value();
-            Simulation<Solver, Model> simulation (model, seed, step_cutoff);
-            simulation.execute_steps(step_cutoff);
+            seed = maybe_seed.value();
+
+            if constexpr (is_resettable_simulation<Simulation>::value) {
+                if (simulation) {
+                    simulation->reset(seed);
+                    run(simulation.value(), seed);
+                    continue;
+                }
+            }
+
+            simulation.emplace(model, seed, step_cutoff);
+            simulation->history.pool = &buffer_pool;
+            simulation->history.sink =
+                [&] (std::vector<HistoryElement> &&chunk, long int first_step) {
+                    send_chunk(
+                        chunk,
+                        HistoryPacket {
+                            .history = {},
+                            .seed = seed,
+                            .first_step = first_step,
+                            .finished = false
+                        });
+                };
+
+            run(simulation.value(), seed);
+        }
+    }
+
+    // run a trajectory and send its last chunk
+    void run(
+        SimulationType<Solver, Model> &simulation,
+        unsigned long int seed) {
 
-            // Calling resize() with a smaller size has no effect on the capacity of a vector.
-            // It will not free memory.
-            simulation.history.resize(simulation.step);
-            history_queue.insert_history(
-                std::move(
-                    HistoryPacket {
-                        .history = std::move(simulation.history),
-                        .seed = seed
-                        }));
+        HistoryPacket packet {
+            .history = {},
+            .seed = seed,
+            .first_step = 0,
+            .finished = true
+        };
+
+        if constexpr (has_stopping_monitor<SimulationType<Solver, Model>>::value) {
+            simulation.stopping.start(stopping_condition);
+            simulation.execute_steps(step_cutoff);
+            packet.stopped = simulation.stopping.stopped;
+            packet.first_passage_time = simulation.stopping.first_passage_time;
+            packet.alternative = simulation.stopping.alternative;
+        } else {
+            simulation.execute_steps(step_cutoff);
         }
+
+        packet.first_step = simulation.history.flushed_firings;
+        send_chunk(simulation.history.chunk, std::move(packet));
+    }
+
+    // the writer puts chunk back into the pool once it is written
+    void send_chunk(
+        std::vector<HistoryElement> &chunk,
+        HistoryPacket packet) {
+
+        packet.history = std::move(chunk);
+        history_queue.insert_history(std::move(packet));
     }
 };
 
@@ -57,7 +205,8 @@ template <
     typename Solver,
     typename Model,
     typename Parameters,
-    typename TrajectoriesSql>
+    typename TrajectoriesSql,
+    template <typename, typename> class SimulationType = Simulation>
 
 struct Dispatcher {
     SqlConnection model_database;
@@ -67,8 +216,18 @@ struct Dispatcher {
     SqlWriter<TrajectoriesSql> trajectories_writer;
     HistoryQueue<HistoryPacket> history_queue;
     SeedQueue seed_queue;
+    BufferPool<HistoryElement> buffer_pool;
+    StoppingCondition stopping_condition;
+
+    // only prepared if there is a stopping condition, since the table
+    // is created then
+    std::optional<SqlStatement<FirstPassageSql>> first_passage_stmt;
+
+    // only prepared for simulations which record leaps, since the
+    // table is created then
+    std::optional<SqlStatement<LeapsSql>> leaps_stmt;
     std::vector<std::thread> threads;
-    int step_cutoff;
+    long int step_cutoff;
     int number_of_simulations;
     int number_of_threads;
 
@@ -78,8 +237,9 @@ struct Dispatcher {
         unsigned long int number_of_simulations,
         unsigned long int base_seed,
         int number_of_threads,
-        int step_cutoff,
-        Parameters parameters) :
+        long int step_cutoff,
+        Parameters parameters,
+        StoppingCondition stopping_condition) :
         model_database (
             model_database_file,
             SQLITE_OPEN_READWRITE),
@@ -92,9 +252,16 @@ struct Dispatcher {
             parameters),
         trajectories_stmt (initial_state_database),
         trajectories_writer (trajectories_stmt),
-        history_queue (),
+        // a thread can only get this many chunks ahead of the writer,
+        // so memory use doesn't depend on how long trajectories are.
+        history_queue (2 * number_of_threads),
         seed_queue (number_of_simulations, base_seed),
 
+        // enough for every packet in the queue and the chunks the
+        // simulator threads are filling
+        buffer_pool (4 * number_of_threads),
+        stopping_condition (stopping_condition),
+
         // don't want to start threads in the constructor.
         threads (),
         step_cutoff (step_cutoff),
@@ -103,7 +270,7 @@ struct Dispatcher {
         {};
 
     void run_dispatcher();
-    void record_simulation_history(HistoryPacket history_packet);
+    void record_simulation_history(HistoryPacket &history_packet);
 };
 
 
@@ -112,18 +279,53 @@ template <
     typename Solver,
     typename Model,
     typename Parameters,
-    typename TrajectoriesSql>
+    typename TrajectoriesSql,
+    template <typename, typename> class SimulationType>
+
+void Dispatcher<Solver, Model, Parameters, TrajectoriesSql, SimulationType>::run_dispatcher() {
+
+    if (! stopping_condition.empty()) {
+        if constexpr (! has_stopping_monitor<SimulationType<Solver, Model>>::value) {
+            std::cerr << time_stamp()
+                      << "stopping conditions aren't supported by this solver\n";
+            std::exit(EXIT_FAILURE);
+        }
+
+        if (! stopping_condition.compile(model.initial_state))
+            std::exit(EXIT_FAILURE);
 
-void Dispatcher<Solver, Model, Parameters, TrajectoriesSql>::run_dispatcher() {
+        initial_state_database.exec(
+            "CREATE TABLE IF NOT EXISTS first_passage ("
+            "seed INTEGER NOT NULL, "
+            "time REAL NOT NULL, "
+            "condition INTEGER NOT NULL);");
+
+        first_passage_stmt.emplace(initial_state_database);
+    }
+
+    if constexpr (records_leaps<SimulationType<Solver, Model>>::value) {
+        initial_state_database.exec(
+            "CREATE TABLE IF NOT EXISTS leaps ("
+            "seed INTEGER NOT NULL, "
+            "step INTEGER NOT NULL, "
+            "reaction_id INTEGER NOT NULL, "
+            "count INTEGER NOT NULL, "
+            "time REAL NOT NULL);");
+
+        leaps_stmt.emplace(initial_state_database);
+    }
 
     threads.resize(number_of_threads);
     for (int i = 0; i < number_of_threads; i++) {
         threads[i] = std::thread (
-            [](SimulatorPayload<Solver, Model> payload) {payload.run_simulator();},
-            SimulatorPayload<Solver, Model> (
+            [](SimulatorPayload<Solver, Model, SimulationType> payload) {
+                payload.run_simulator();},
+            SimulatorPayload<Solver, Model, SimulationType> (
                 model,
                 history_queue,
                 seed_queue,
+                buffer_pool,
+                stopping_condition.empty() ? nullptr : &stopping_condition,
                 step_cutoff)
             );
 
@@ -137,17 +339,30 @@ void Dispatcher<Solver, Model, Parameters, TrajectoriesSql>::run_dispatcher() {
 
         if (maybe_history_packet) {
             HistoryPacket history_packet = std::move(maybe_history_packet.value());
-            record_simulation_history(std::move(history_packet));
-            trajectories_written += 1;
+            record_simulation_history(history_packet);
+            if (history_packet.finished) trajectories_written += 1;
+            buffer_pool.put(std::move(history_packet.history));
         };
     }
 
     for (int i = 0; i < number_of_threads; i++) threads[i].join();
 
+    std::cerr << time_stamp()
+              << "history buffers: "
+              << buffer_pool.allocations
+              << " allocated, "
+              << buffer_pool.reuses
+              << " reused\n";
+
     initial_state_database.exec(
         "DELETE FROM trajectories WHERE rowid NOT IN"
         "(SELECT MIN(rowid) FROM trajectories GROUP BY seed, step);");
 
+    if (leaps_stmt)
+        initial_state_database.exec(
+            "DELETE FROM leaps WHERE rowid NOT IN"
+            "(SELECT MIN(rowid) FROM leaps GROUP BY seed, step);");
+
     std::cerr << time_stamp()
               << "removing duplicate trajectories...\n";
 
@@ -158,29 +373,57 @@ template <
     typename Solver,
     typename Model,
     typename Parameters,
-    typename TrajectoriesSql
+    typename TrajectoriesSql,
+    template <typename, typename> class SimulationType
     >
-void Dispatcher<Solver, Model, Parameters, TrajectoriesSql>::record_simulation_history(HistoryPacket history_packet) {
+void Dispatcher<Solver, Model, Parameters, TrajectoriesSql, SimulationType>::record_simulation_history(HistoryPacket &history_packet) {
     int count = 0;
+    long int step = history_packet.first_step;
     constexpr int transaction_size = 20000;
+
     initial_state_database.exec("BEGIN");
-    for (unsigned long int i = 0; i < history_packet.history.size(); i++) {
-        trajectories_writer.insert(
-            model.history_element_to_sql(
-                (int) history_packet.seed,
-                (int) i,
-                history_packet.history[i]));
+
+    // step counts reactions, so an element which records several
+    // firings advances it by its count
+    for (HistoryElement &element : history_packet.history) {
+        if constexpr (! records_leaps<SimulationType<Solver, Model>>::value) {
+            trajectories_writer.insert(
+                model.history_element_to_sql(
+                    (int) history_packet.seed,
+                    step,
+                    element));
+        } else {
+            SqlWriter<LeapsSql> leaps_writer (leaps_stmt.value());
+            leaps_writer.insert(
+                LeapsSql {
+                    .seed = (int) history_packet.seed,
+                    .step = step,
+                    .reaction_id = element.reaction_id,
+                    .count = element.count,
+                    .time = element.time});
+        }
+
+        step += element.count;
         count++;
         if (count % transaction_size == 0) {
             initial_state_database.exec("COMMIT;");
             initial_state_database.exec("BEGIN");
-
         }
     }
     initial_state_database.exec("COMMIT;");
 
-    std::cerr << time_stamp()
-              << "wrote trajectory "
-              << history_packet.seed
-              << " to database\n";
+    if (history_packet.stopped) {
+        SqlWriter<FirstPassageSql> first_passage_writer (first_passage_stmt.value());
+        first_passage_writer.insert(
+            FirstPassageSql {
+                .seed = (int) history_packet.seed,
+                .time = history_packet.first_passage_time,
+                .condition = history_packet.alternative});
+    }
+
+    if (history_packet.finished)
+        std::cerr << time_stamp()
+                  << "wrote trajectory "
+                  << history_packet.seed
+                  << " to database\n";
 };
@@ -0,0 +1,84 @@
+#pragma once
+#include "simulation.h"
+
+// approximate simulations fire many reactions at once. FiringRecorder
+// writes each reaction which fired in a step as a single history
+// element with the number of times it fired. If snapshot_interval is
+// positive, firings are instead collected until the next multiple of
+// snapshot_interval and written as one element per reaction, stamped
+// with the snapshot time, so replaying a trajectory up to a snapshot
+// time gives the state at that time. Simulations have to call advance
+// before recording firings which happened after a snapshot time, and
+// must not step over next_snapshot.
+
+struct FiringRecorder {
+    History &history;
+    double snapshot_interval;
+    double next_snapshot;
+    long int number_of_firings;
+
+    // firings since the last snapshot
+    std::vector<int> pending_counts;
+    std::vector<int> pending_reactions;
+
+    FiringRecorder(History &history,
+                   double snapshot_interval,
+                   unsigned long int number_of_reactions) :
+        history (history),
+        snapshot_interval (snapshot_interval),
+        next_snapshot (snapshot_interval),
+        number_of_firings (0),
+        pending_counts (snapshot_interval > 0.0 ? number_of_reactions : 0, 0) {};
+
+    bool snapshots() { return snapshot_interval > 0.0; };
+    void record(int reaction_index, int count, double time);
+    void record_snapshot(double snapshot_time);
+
+    // record the snapshots at or before time
+    void advance(double time);
+
+    // record the firings since the last snapshot at time
+    void finish(double time);
+};
+
+
+void FiringRecorder::record(int reaction_index, int count, double time) {
+    number_of_firings += count;
+
+    if (snapshots()) {
+        if (pending_counts[reaction_index] == 0)
+            pending_reactions.push_back(reaction_index);
+
+        pending_counts[reaction_index] += count;
+    } else {
+        history.push_back(HistoryElement {
+                .reaction_id = reaction_index,
+                .count = count,
+                .time = time});
+    }
+};
+
+void FiringRecorder::record_snapshot(double snapshot_time) {
+    for (int j : pending_reactions) {
+        history.push_back(HistoryElement {
+                .reaction_id = j,
+                .count = pending_counts[j],
+                .time = snapshot_time});
+        pending_counts[j] = 0;
+    }
+
+    pending_reactions.clear();
+};
+
+void FiringRecorder::advance(double time) {
+    if (! snapshots()) return;
+
+    while (next_snapshot <= time) {
+        record_snapshot(next_snapshot);
+        next_snapshot += snapshot_interval;
+    }
+};
+
+void FiringRecorder::finish(double time) {
+    if (snapshots()) record_snapshot(time);
+};
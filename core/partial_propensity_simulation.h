@@ -0,0 +1,241 @@
+#pragma once
+#include "simulation.h"
+
+// partial propensity direct method, as described in
+// https://doi.org/10.1063/1.3154624
+//
+// For mass action kinetics, the propensity of a reaction is the count
+// of one of its reactants times a partial propensity which depends on
+// at most one other state entry. The reactions are grouped into rows
+// by that reactant, so the propensity of a row is the count of its
+// state entry times the sum of its partial propensities. The solver
+// samples a row, and a reaction in the row is chosen from a binary
+// tree over its partial propensities. When a state entry changes, we
+// only need to update the propensity of its own row and the partial
+// propensities which depend on it, so the cost of a step scales with
+// the number of reactions coupled through the second reactant, not
+// with the number of reactions a state entry appears in. Models
+// should put a reaction into the row of the reactant which appears in
+// the most reactions, so that hub species only touch their own row.
+//
+// There is an extra row after the state entries for reactions which
+// don't depend on the state. Its count is taken to be 1.
+//
+// Models need to implement the following on top of the Simulation
+// interface:
+//
+// int changed_state_entries(int reaction_index, int changed_state[4]);
+// PartialPropensityTable &get_partial_propensity_table();
+// double compute_partial_propensity(
+//     std::vector<int> &state,
+//     int reaction_index,
+//     int row);
+
+struct PartialPropensityTable {
+    // the entries of row i are row_offsets[i] to row_offsets[i + 1] - 1
+    std::vector<int> row_offsets;
+    std::vector<int> entry_reactions; // reaction of each entry
+    std::vector<int> entry_rows; // row of each entry
+
+    // the entries whose partial propensity depends on state entry i
+    // are dependent_entries[dependent_offsets[i]] to
+    // dependent_entries[dependent_offsets[i + 1] - 1]
+    std::vector<int> dependent_offsets;
+    std::vector<int> dependent_entries;
+};
+
+template <typename Solver, typename Model>
+struct PartialPropensitySimulation {
+    Model &model;
+    PartialPropensityTable &table;
+    unsigned long int seed;
+    std::vector<int> state;
+
+    // the tree of a row with n entries is stored at 2 * row_offsets[i]
+    // and has 2 * n slots. Node 1 is the root, node k has children 2k
+    // and 2k + 1 and entry l of the row is node n + l, so every
+    // internal node has two children for any n. Slot 0 is unused.
+    // Sums are recomputed from the children, so there is no drift.
+    std::vector<double> partial_trees;
+
+    // only used to construct the solver, which keeps its own copy
+    std::vector<double> row_propensities;
+    double time;
+    long int step; // number of reactions which have occoured
+    Solver solver; // samples rows
+    Sampler sampler; // samples a reaction within a row
+    History history;
+
+    // rows touched by a step. Their propensities are passed to the
+    // solver as a single batch once all the entries are updated.
+    std::vector<int> dirty_rows;
+    std::vector<Update> update_buffer;
+
+    // the row sampler needs a stream which is independent from the
+    // solver, which is seeded with seed.
+    static constexpr unsigned long int row_seed_mask = 0x9a27a1;
+
+    PartialPropensitySimulation(Model &model,
+                                unsigned long int seed,
+                                long int step_cutoff) :
+        model (model),
+        table (model.get_partial_propensity_table()),
+        seed (seed),
+        state (model.initial_state),
+        partial_trees (2 * table.entry_reactions.size()),
+        row_propensities (compute_initial_trees()),
+        time (0.0),
+        step (0),
+        solver (seed, std::ref(row_propensities)),
+        sampler (seed, row_seed_mask),
+        history (step_cutoff + 1) {
+            row_propensities.clear();
+            row_propensities.shrink_to_fit();
+        };
+
+    int row_count(int row);
+    double row_propensity(int row);
+    std::vector<double> compute_initial_trees();
+    void update_entry(int entry);
+    int find_entry(int row, double value);
+    bool execute_step();
+    void execute_steps(long int step_cutoff);
+};
+
+
+template <typename Solver, typename Model>
+int PartialPropensitySimulation<Solver, Model>::row_count(int row) {
+    if (row < (int) state.size()) return state[row];
+    else return 1;
+};
+
+template <typename Solver, typename Model>
+double PartialPropensitySimulation<Solver, Model>::row_propensity(int row) {
+    int size = table.row_offsets[row + 1] - table.row_offsets[row];
+    if (size == 0) return 0.0;
+
+    return row_count(row) * partial_trees[2 * table.row_offsets[row] + 1];
+};
+
+template <typename Solver, typename Model>
+std::vector<double> PartialPropensitySimulation<Solver, Model>::compute_initial_trees() {
+    int number_of_rows = table.row_offsets.size() - 1;
+    std::vector<double> propensities (number_of_rows);
+
+    for (int row = 0; row < number_of_rows; row++) {
+        int offset = table.row_offsets[row];
+        int size = table.row_offsets[row + 1] - offset;
+        double *tree = &partial_trees[2 * offset];
+
+        for (int l = 0; l < size; l++)
+            tree[size + l] = model.compute_partial_propensity(
+                state, table.entry_reactions[offset + l], row);
+
+        for (int k = size - 1; k > 0; k--)
+            tree[k] = tree[2 * k] + tree[2 * k + 1];
+
+        propensities[row] = row_propensity(row);
+    }
+
+    return propensities;
+};
+
+template <typename Solver, typename Model>
+void PartialPropensitySimulation<Solver, Model>::update_entry(int entry) {
+    int row = table.entry_rows[entry];
+    int offset = table.row_offsets[row];
+    int size = table.row_offsets[row + 1] - offset;
+    double *tree = &partial_trees[2 * offset];
+
+    int k = size + entry - offset;
+    tree[k] = model.compute_partial_propensity(
+        state, table.entry_reactions[entry], row);
+
+    for (k /= 2; k > 0; k /= 2)
+        tree[k] = tree[2 * k] + tree[2 * k + 1];
+};
+
+template <typename Solver, typename Model>
+int PartialPropensitySimulation<Solver, Model>::find_entry(int row, double value) {
+    int offset = table.row_offsets[row];
+    int size = table.row_offsets[row + 1] - offset;
+    double *tree = &partial_trees[2 * offset];
+
+    // rounding can push value past the last nonzero subtree, so we
+    // never descend into a subtree with zero sum.
+    int k = 1;
+    while (k < size) {
+        if (value <= tree[2 * k] || tree[2 * k + 1] == 0.0) k = 2 * k;
+        else {
+            value -= tree[2 * k];
+            k = 2 * k + 1;
+        }
+    }
+
+    return offset + k - size;
+};
+
+template <typename Solver, typename Model>
+bool PartialPropensitySimulation<Solver, Model>::execute_step() {
+    std::optional<Event> maybe_event = solver.event();
+    if (! maybe_event) return false;
+
+    Event event = maybe_event.value();
+    time += event.dt;
+
+    int row = event.index;
+    double value = sampler.generate()
+        * partial_trees[2 * table.row_offsets[row] + 1];
+    int next_reaction = table.entry_reactions[find_entry(row, value)];
+
+    // record what happened
+    history.push_back(HistoryElement {
+        .reaction_id = next_reaction,
+        .time = time});
+
+    step++;
+
+    model.update_state(std::ref(state), next_reaction);
+
+    int changed_state[4];
+    int number_of_changed_entries =
+        model.changed_state_entries(next_reaction, changed_state);
+
+    for (int k = 0; k < number_of_changed_entries; k++) {
+        int i = changed_state[k];
+
+        bool seen = false;
+        for (int l = 0; l < k; l++)
+            if (changed_state[l] == i) seen = true;
+        if (seen) continue;
+
+        for (int m = table.dependent_offsets[i];
+             m < table.dependent_offsets[i + 1];
+             m++) {
+            int entry = table.dependent_entries[m];
+            update_entry(entry);
+            dirty_rows.push_back(table.entry_rows[entry]);
+        }
+
+        dirty_rows.push_back(i);
+    }
+
+    for (int dirty_row : dirty_rows)
+        update_buffer.push_back(Update {
+                .index = (unsigned long int) dirty_row,
+                .propensity = row_propensity(dirty_row)});
+
+    solver.update(update_buffer);
+    update_buffer.clear();
+    dirty_rows.clear();
+
+    return true;
+};
+
+template <typename Solver, typename Model>
+void PartialPropensitySimulation<Solver, Model>::execute_steps(long int step_cutoff) {
+    while(execute_step()) {
+        if (step > step_cutoff)
+            break;
+    }
+};
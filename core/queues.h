@@ -1,6 +1,9 @@
 #pragma once
 #include <queue>
+#include <vector>
+#include <algorithm>
 #include <mutex>
+#include <condition_variable>
 #include <optional>
 
 
@@ -49,21 +52,33 @@ struct HistoryQueue {
     // to exactly the same memory as the vector which is used to write
     // to the initial state database, and every time a move is
     // supposed to happen, the old reference is actually zerod out).
+    //
+    // Simulations hand over their history a chunk at a time. Once the
+    // queue holds capacity packets, insert_history blocks until the
+    // dispatcher takes one out, so the simulator threads can't run
+    // arbitrarily far ahead of the writer.
     std::queue<T> history_packets;
     std::mutex mutex;
+    std::condition_variable not_full;
+    unsigned long int capacity;
+
+    HistoryQueue(unsigned long int capacity) : capacity (capacity) {};
 
     void insert_history(T history_packet) {
-        std::lock_guard<std::mutex> lock (mutex);
+        std::unique_lock<std::mutex> lock (mutex);
+        not_full.wait(lock, [&] { return history_packets.size() < capacity; });
         history_packets.push(std::move(history_packet));
     }
 
     std::optional<T> get_history() {
-        std::lock_guard<std::mutex> lock (mutex);
+        std::unique_lock<std::mutex> lock (mutex);
         if (history_packets.empty()) {
             return std::optional<T> ();
         } else {
             T result = std::move(history_packets.front());
             history_packets.pop();
+            lock.unlock();
+            not_full.notify_one();
             return std::optional<T> (std::move(result));
 
         }
@@ -71,3 +86,75 @@ struct HistoryQueue {
 
 };
 
+
+
+// recycles the buffers which trajectory histories are written into.
+// Without it, every chunk of history is allocated by a simulator
+// thread and freed by the dispatcher thread, which makes the
+// allocator move memory between thread arenas and touch fresh pages
+// for every trajectory. The dispatcher puts buffers back once they
+// are written, and simulators get them from here.
+//
+// Buffers are kept in size classes of 2^k elements, so a short
+// trajectory only ever takes a small buffer, and each class keeps at
+// most max_free_buffers, so a burst of long trajectories can't pin
+// memory forever. allocations counts the buffers which weren't
+// available from the pool, so it stops growing once the run reaches
+// a steady state.
+template <typename T>
+struct BufferPool {
+    static constexpr int smallest_class = 8;
+    static constexpr int number_of_classes = 24;
+
+    std::vector<std::vector<T>> free_buffers[number_of_classes];
+    std::mutex mutex;
+    unsigned long int max_free_buffers;
+    unsigned long int allocations;
+    unsigned long int reuses;
+
+    BufferPool(unsigned long int max_free_buffers) :
+        max_free_buffers (max_free_buffers),
+        allocations (0),
+        reuses (0) {};
+
+    static unsigned long int class_capacity(int size_class) {
+        return 1ul << (size_class + smallest_class);
+    };
+
+    // an empty buffer with capacity at least capacity
+    std::vector<T> get(unsigned long int capacity) {
+        int size_class = 0;
+        while (size_class < number_of_classes - 1 &&
+               class_capacity(size_class) < capacity)
+            size_class++;
+
+        std::lock_guard<std::mutex> lock (mutex);
+        std::vector<std::vector<T>> &buffers = free_buffers[size_class];
+        if (! buffers.empty() && buffers.back().capacity() >= capacity) {
+            std::vector<T> result = std::move(buffers.back());
+            buffers.pop_back();
+            reuses++;
+            return result;
+        }
+
+        allocations++;
+        std::vector<T> result;
+        result.reserve(std::max(capacity, class_capacity(size_class)));
+        return result;
+    };
+
+    // buffers smaller than the smallest class are freed
+    void put(std::vector<T> &&buffer) {
+        if (buffer.capacity() < class_capacity(0)) return;
+
+        int size_class = 0;
+        while (size_class < number_of_classes - 1 &&
+               class_capacity(size_class + 1) <= buffer.capacity())
+            size_class++;
+
+        buffer.clear();
+        std::lock_guard<std::mutex> lock (mutex);
+        if (free_buffers[size_class].size() < max_free_buffers)
+            free_buffers[size_class].push_back(std::move(buffer));
+    };
+};
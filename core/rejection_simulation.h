@@ -0,0 +1,191 @@
+#pragma once
+#include "simulation.h"
+
+// rejection based SSA, as described in
+// https://doi.org/10.1063/1.4896985
+//
+// Simulation recomputes the propensity of every dependent reaction
+// after each step. Instead, we keep an interval around each state
+// entry and lower and upper bounds on each propensity which hold as
+// long as the state stays inside the intervals. The solver samples a
+// candidate reaction from the upper bounds. The candidate is accepted
+// without computing its propensity if a uniform variate falls below
+// the lower bound, and otherwise we compute the exact propensity of
+// the candidate only. Bounds are recomputed only for the reactions
+// depending on a state entry which has left its interval.
+//
+// Models need to implement the following on top of the Simulation
+// interface:
+//
+// int changed_state_entries(int reaction_index, int changed_state[4]);
+// std::vector<int> &get_state_dependents(int state_index);
+// StateBounds compute_state_bounds(std::vector<int> &state, int state_index);
+// PropensityBounds compute_propensity_bounds(
+//     std::vector<int> &lower_state,
+//     std::vector<int> &upper_state,
+//     int reaction_index);
+
+struct StateBounds {
+    int lower;
+    int upper;
+};
+
+struct PropensityBounds {
+    double lower;
+    double upper;
+};
+
+template <typename Solver, typename Model>
+struct RejectionSimulation {
+    Model &model;
+    unsigned long int seed;
+    std::vector<int> state;
+    std::vector<int> lower_state;
+    std::vector<int> upper_state;
+    std::vector<double> lower_propensities;
+
+    // only used to construct the solver, which keeps its own copy
+    std::vector<double> upper_propensities;
+    double time;
+    long int step; // number of reactions which have occoured
+    Solver solver; // samples candidates from the upper bounds
+    Sampler sampler; // acceptance variates
+    History history;
+
+    // if this many candidates are rejected in a row, we check whether
+    // the exact propensities are all zero, since the upper bounds can
+    // be nonzero in a state where nothing can happen.
+    unsigned long int rejection_limit;
+
+    // the acceptance sampler needs a stream which is independent from
+    // the solver, which is seeded with seed.
+    static constexpr unsigned long int acceptance_seed_mask = 0x5eed5eed;
+
+    RejectionSimulation(Model &model,
+                        unsigned long int seed,
+                        long int step_cutoff) :
+        model (model),
+        seed (seed),
+        state (model.initial_state),
+        lower_state (state.size()),
+        upper_state (state.size()),
+        lower_propensities (model.initial_propensities.size()),
+        upper_propensities (compute_initial_bounds()),
+        time (0.0),
+        step (0),
+        solver (seed, std::ref(upper_propensities)),
+        sampler (seed, acceptance_seed_mask),
+        history (step_cutoff + 1),
+        rejection_limit (1024) {
+            upper_propensities.clear();
+            upper_propensities.shrink_to_fit();
+        };
+
+    std::vector<double> compute_initial_bounds();
+    void update_bounds(int state_index);
+    bool execute_step();
+    void execute_steps(long int step_cutoff);
+};
+
+
+template <typename Solver, typename Model>
+std::vector<double> RejectionSimulation<Solver, Model>::compute_initial_bounds() {
+    for (unsigned long int i = 0; i < state.size(); i++) {
+        StateBounds bounds = model.compute_state_bounds(state, i);
+        lower_state[i] = bounds.lower;
+        upper_state[i] = bounds.upper;
+    }
+
+    std::vector<double> upper (lower_propensities.size());
+    for (unsigned long int i = 0; i < lower_propensities.size(); i++) {
+        PropensityBounds bounds = model.compute_propensity_bounds(
+            lower_state, upper_state, i);
+        lower_propensities[i] = bounds.lower;
+        upper[i] = bounds.upper;
+    }
+
+    return upper;
+};
+
+template <typename Solver, typename Model>
+void RejectionSimulation<Solver, Model>::update_bounds(int state_index) {
+    StateBounds bounds = model.compute_state_bounds(state, state_index);
+    lower_state[state_index] = bounds.lower;
+    upper_state[state_index] = bounds.upper;
+
+    std::vector<int> &dependents = model.get_state_dependents(state_index);
+    for (unsigned long int m = 0; m < dependents.size(); m++) {
+        unsigned long int reaction_index = dependents[m];
+        PropensityBounds propensity_bounds = model.compute_propensity_bounds(
+            lower_state, upper_state, reaction_index);
+
+        lower_propensities[reaction_index] = propensity_bounds.lower;
+        solver.update(Update {
+                .index = reaction_index,
+                .propensity = propensity_bounds.upper});
+    }
+};
+
+template <typename Solver, typename Model>
+bool RejectionSimulation<Solver, Model>::execute_step() {
+    unsigned long int rejections = 0;
+    int next_reaction;
+
+    while (true) {
+        std::optional<Event> maybe_event = solver.event();
+        if (! maybe_event) return false;
+
+        // candidates arrive at the rate of the upper bound, so time
+        // advances for rejected candidates as well.
+        Event event = maybe_event.value();
+        time += event.dt;
+        next_reaction = event.index;
+
+        double r = sampler.generate() * solver.get_propensity(next_reaction);
+        if (r < lower_propensities[next_reaction] ||
+            r < model.compute_propensity(state, next_reaction))
+            break;
+
+        rejections++;
+        if (rejections == rejection_limit) {
+            double propensity_sum = 0.0;
+            for (unsigned long int i = 0; i < lower_propensities.size(); i++)
+                propensity_sum += model.compute_propensity(state, i);
+
+            if (propensity_sum == 0.0) return false;
+
+            // make sure the check stays amortized
+            rejection_limit *= 2;
+        }
+    }
+
+    // record what happened
+    history.push_back(HistoryElement {
+        .reaction_id = next_reaction,
+        .time = time});
+
+    step++;
+
+    model.update_state(std::ref(state), next_reaction);
+
+    // refresh bounds for the state entries which left their interval
+    int changed_state[4];
+    int number_of_changed_entries =
+        model.changed_state_entries(next_reaction, changed_state);
+
+    for (int k = 0; k < number_of_changed_entries; k++) {
+        int i = changed_state[k];
+        if (state[i] < lower_state[i] || state[i] > upper_state[i])
+            update_bounds(i);
+    }
+
+    return true;
+};
+
+template <typename Solver, typename Model>
+void RejectionSimulation<Solver, Model>::execute_steps(long int step_cutoff) {
+    while(execute_step()) {
+        if (step > step_cutoff)
+            break;
+    }
+};
@@ -1,13 +1,28 @@
 #pragma once
 #include <gsl/gsl_rng.h>
+#include <gsl/gsl_randist.h>
 #include <utility>
+#include <cmath>
+#include <cstdint>
+#include <type_traits>
 
 // we are using GSL random number generation because i don't trust
 // random number generation to be consistent across various C++ stdlib
 // implementations, and for the kind of MC simulator we are writing here,
 // we want to be able to run it deterministically for testing purposes.
+//
+// Sampler is PhiloxSampler, a block buffered counter based generator
+// with its own variate algorithms, unless RNMC_GSL_SAMPLER is defined,
+// in which case it is GslSampler. The two produce different streams
+// for the same seed. GslSampler gives the trajectories of earlier
+// versions, which the reference trajectories in test_materials were
+// generated with, so build.sh also builds GMC and NPMC with it into
+// build/gsl for test.sh.
+//
+// Both can be constructed from a seed and a stream. Simulations which
+// need more than one sampler give each one its own stream.
 
-class Sampler {
+class GslSampler {
 private:
     gsl_rng *internal_rng_state;
 public:
@@ -16,32 +31,57 @@ public:
         return gsl_rng_uniform_pos(internal_rng_state);
     };
 
-    Sampler(unsigned long int n) :
+    unsigned int poisson(double mean) {
+        return gsl_ran_poisson(internal_rng_state, mean);
+    };
+
+    // standard normal variate
+    double gaussian() {
+        return gsl_ran_ugaussian(internal_rng_state);
+    };
+
+    // standard exponential variate, computed from a single uniform
+    double exponential() {
+        return - std::log(generate());
+    };
+
+    GslSampler(unsigned long int n) :
         seed (n) {
         internal_rng_state = gsl_rng_alloc(gsl_rng_default);
         gsl_rng_set(internal_rng_state, seed);
         };
 
-    ~Sampler() {
+    // GSL generators only take a seed, so the stream is xored into it,
+    // which is how simulations have always derived their extra samplers.
+    GslSampler(unsigned long int n, unsigned long int stream) :
+        GslSampler(n ^ stream) {};
+
+    // same state as a new sampler with seed n, without reallocating
+    void reseed(unsigned long int n, unsigned long int stream = 0) {
+        seed = n ^ stream;
+        gsl_rng_set(internal_rng_state, seed);
+    };
+
+    ~GslSampler() {
         gsl_rng_free(internal_rng_state);
     };
 
     // since we don't have access to gsl internal state, can't write
     // copy constructor
-    Sampler(Sampler &other) = delete;
+    GslSampler(GslSampler &other) = delete;
 
     // move constructor
-    Sampler(Sampler &&other) :
+    GslSampler(GslSampler &&other) :
         internal_rng_state (std::exchange(other.internal_rng_state, nullptr)),
         seed (other.seed)
         {};
 
     // since we don't have access to gsl internal state, can't write
     // copy assignment operator
-    Sampler &operator=(Sampler &other) = delete;
+    GslSampler &operator=(GslSampler &other) = delete;
 
     // move assignment operator
-    Sampler &operator=(Sampler &&other) {
+    GslSampler &operator=(GslSampler &&other) {
         seed = other.seed;
 
         // we move the existing internal_rng_state into other so
@@ -51,3 +91,265 @@ public:
     };
 
 };
+
+
+// tables of the exponential ziggurat of Marsaglia and Tsang:
+// https://doi.org/10.18637/jss.v005.i08
+// with 53 bit uniforms. Layer 0 is the base strip including the tail
+// beyond tail_start, and layer i has width widths[i] * 2^53. A
+// uniform u below thresholds[i] is inside the next narrower layer, so
+// u * widths[i] is accepted without evaluating the density, which
+// happens about 99% of the time.
+struct ExponentialZiggurat {
+    uint64_t thresholds[256];
+    double widths[256];
+    double heights[256]; // density at the outer edge of each layer
+
+    static constexpr double tail_start = 7.697117470131487;
+    static constexpr double layer_area = 3.949659822581572e-3;
+
+    ExponentialZiggurat() {
+        constexpr double scale = 0x1.0p53;
+        double x = tail_start;
+        double previous = x;
+        double base_width = layer_area / std::exp(- x);
+
+        thresholds[0] = (x / base_width) * scale;
+        thresholds[1] = 0;
+        widths[0] = base_width / scale;
+        widths[255] = x / scale;
+        heights[0] = 1.0;
+        heights[255] = std::exp(- x);
+
+        for (int i = 254; i >= 1; i--) {
+            x = - std::log(layer_area / x + std::exp(- x));
+            thresholds[i + 1] = (x / previous) * scale;
+            previous = x;
+            heights[i] = std::exp(- x);
+            widths[i] = x / scale;
+        }
+    };
+};
+
+
+// Philox4x32-10 counter based generator, as described in
+// https://doi.org/10.1145/2063384.2063405
+//
+// The key is the seed and the counter is the stream followed by a
+// block index, so every (seed, stream) pair is an independent
+// sequence of blocks of 4 32 bit words, written out as 2 64 bit
+// outputs. fill computes lanes consecutive blocks at once, with the
+// rounds applied to all of them in turn so the compiler can vectorize
+// across blocks.
+struct PhiloxEngine {
+    uint32_t key[2];
+    uint64_t stream;
+
+    static constexpr int lanes = 32;
+    static constexpr int outputs_per_fill = 2 * lanes;
+
+    static constexpr uint32_t multiplier_0 = 0xD2511F53;
+    static constexpr uint32_t multiplier_1 = 0xCD9E8D57;
+    static constexpr uint32_t weyl_0 = 0x9E3779B9;
+    static constexpr uint32_t weyl_1 = 0xBB67AE85;
+
+    PhiloxEngine(uint64_t seed, uint64_t stream) :
+        key {(uint32_t) seed, (uint32_t) (seed >> 32)},
+        stream (stream) {};
+
+    // the outputs of blocks lanes * fill_index to
+    // lanes * fill_index + lanes - 1
+    void fill(uint64_t fill_index, uint64_t outputs[outputs_per_fill]) const {
+        uint32_t c0[lanes], c1[lanes], c2[lanes], c3[lanes];
+        for (int l = 0; l < lanes; l++) {
+            uint64_t block = fill_index * lanes + l;
+            c0[l] = block;
+            c1[l] = block >> 32;
+            c2[l] = stream;
+            c3[l] = stream >> 32;
+        }
+
+        uint32_t k0 = key[0];
+        uint32_t k1 = key[1];
+        for (int round = 0; round < 10; round++) {
+            for (int l = 0; l < lanes; l++) {
+                uint64_t product_0 = (uint64_t) multiplier_0 * c0[l];
+                uint64_t product_1 = (uint64_t) multiplier_1 * c2[l];
+                c0[l] = (uint32_t) (product_1 >> 32) ^ c1[l] ^ k0;
+                c1[l] = product_1;
+                c2[l] = (uint32_t) (product_0 >> 32) ^ c3[l] ^ k1;
+                c3[l] = product_0;
+            }
+
+            k0 += weyl_0;
+            k1 += weyl_1;
+        }
+
+        for (int l = 0; l < lanes; l++) {
+            outputs[2 * l] = ((uint64_t) c0[l] << 32) | c1[l];
+            outputs[2 * l + 1] = ((uint64_t) c2[l] << 32) | c3[l];
+        }
+    };
+};
+
+
+// sampler over an engine which produces blocks of 64 bit outputs.
+// Outputs are generated a fill at a time into a buffer inside the
+// sampler, so generate is an inlined load in the common case and
+// there are no calls through function pointers. Construction doesn't
+// allocate, the state can be copied and written to a checkpoint as
+// is, and skip moves to any position in O(1).
+//
+// Exponential variates use the ziggurat, so the waiting time of a
+// step usually costs a multiplication instead of a log. Poisson
+// variates use multiplication of uniforms for small means and the
+// PTRS transformed rejection method of Hörmann (Insurance:
+// Mathematics and Economics 12, 1993) otherwise. Normal variates use
+// the Box-Muller transform and keep the second variate of each pair
+// for the next call.
+template <typename Engine>
+class BlockSampler {
+private:
+    Engine engine;
+    uint64_t fill_index; // fill the buffer holds
+    uint64_t outputs[Engine::outputs_per_fill];
+    int position; // next output in the buffer
+    bool has_spare_gaussian;
+    double spare_gaussian;
+
+    static inline const ExponentialZiggurat ziggurat {};
+    static constexpr double small_poisson_mean = 10.0;
+    static constexpr double two_pi = 6.283185307179586;
+
+    void refill() {
+        engine.fill(fill_index, outputs);
+        position = 0;
+    };
+
+    uint64_t next_output() {
+        if (position == Engine::outputs_per_fill) {
+            fill_index++;
+            refill();
+        }
+
+        return outputs[position++];
+    };
+
+    unsigned int small_poisson(double mean) {
+        double threshold = std::exp(- mean);
+        unsigned int count = 0;
+        double product = generate();
+        while (product > threshold) {
+            count++;
+            product *= generate();
+        }
+
+        return count;
+    };
+
+    unsigned int large_poisson(double mean) {
+        double sqrt_mean = std::sqrt(mean);
+        double log_mean = std::log(mean);
+        double b = 0.931 + 2.53 * sqrt_mean;
+        double a = -0.059 + 0.02483 * b;
+        double inverse_alpha = 1.1239 + 1.1328 / (b - 3.4);
+        double v_r = 0.9277 - 3.6224 / (b - 2.0);
+
+        while (true) {
+            double u = generate() - 0.5;
+            double v = generate();
+            double us = 0.5 - std::abs(u);
+            double k = std::floor((2.0 * a / us + b) * u + mean + 0.43);
+
+            if (us >= 0.07 && v <= v_r) return k;
+            if (k < 0.0 || (us < 0.013 && v > us)) continue;
+
+            if (std::log(v) + std::log(inverse_alpha) - std::log(a / (us * us) + b)
+                <= - mean + k * log_mean - std::lgamma(k + 1.0))
+                return k;
+        }
+    };
+
+public:
+    unsigned long int seed;
+
+    BlockSampler(unsigned long int n, unsigned long int stream = 0) :
+        engine (n, stream),
+        fill_index (0),
+        has_spare_gaussian (false),
+        spare_gaussian (0.0),
+        seed (n) {
+            refill();
+        };
+
+    void reseed(unsigned long int n, unsigned long int stream = 0) {
+        *this = BlockSampler(n, stream);
+    };
+
+    // uniform on (0, 1), like gsl_rng_uniform_pos
+    double generate() {
+        return ((next_output() >> 11) + 0.5) * 0x1.0p-53;
+    };
+
+    // standard exponential variate. The low 8 bits of an output pick
+    // the layer and the high 53 bits the position in it.
+    double exponential() {
+        while (true) {
+            uint64_t output = next_output();
+            int layer = output & 0xff;
+            uint64_t u = output >> 11;
+            double x = u * ziggurat.widths[layer];
+            if (u < ziggurat.thresholds[layer]) return x;
+
+            if (layer == 0)
+                return ExponentialZiggurat::tail_start - std::log(generate());
+
+            double height = ziggurat.heights[layer] + generate()
+                * (ziggurat.heights[layer - 1] - ziggurat.heights[layer]);
+
+            if (height < std::exp(- x)) return x;
+        }
+    };
+
+    unsigned int poisson(double mean) {
+        if (mean <= 0.0) return 0;
+        if (mean < small_poisson_mean) return small_poisson(mean);
+        return large_poisson(mean);
+    };
+
+    // standard normal variate
+    double gaussian() {
+        if (has_spare_gaussian) {
+            has_spare_gaussian = false;
+            return spare_gaussian;
+        }
+
+        double radius = std::sqrt(-2.0 * std::log(generate()));
+        double angle = two_pi * generate();
+        spare_gaussian = radius * std::sin(angle);
+        has_spare_gaussian = true;
+        return radius * std::cos(angle);
+    };
+
+    // move forward by count outputs, as if generate had been called
+    // count times. Drops a kept normal variate.
+    void skip(uint64_t count) {
+        uint64_t total = fill_index * Engine::outputs_per_fill + position + count;
+        fill_index = total / Engine::outputs_per_fill;
+        refill();
+        position = total % Engine::outputs_per_fill;
+        has_spare_gaussian = false;
+    };
+};
+
+using PhiloxSampler = BlockSampler<PhiloxEngine>;
+
+static_assert(std::is_trivially_copyable<PhiloxSampler>::value,
+              "PhiloxSampler state must be copyable as bytes");
+
+
+#ifdef RNMC_GSL_SAMPLER
+using Sampler = GslSampler;
+#else
+using Sampler = PhiloxSampler;
+#endif
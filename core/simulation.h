@@ -1,31 +1,157 @@
 #pragma once
 #include "solvers.h"
+#include "queues.h"
+#include "stopping_condition.h"
 #include <functional>
+#include <algorithm>
+#include <limits>
 
 
 struct HistoryElement {
     int reaction_id; // reaction which fired
+
+    // number of times the reaction fired. Approximate simulations
+    // record many firings in a single element. It fits in the padding
+    // before time, so it doesn't make the history any larger.
+    int count = 1;
     double time;  // time after reaction has occoured.
 };
 
+// the history of a single trajectory. Elements are collected into a
+// chunk, and every time the chunk fills up it is handed to sink,
+// which the dispatcher uses to pass it on to the writer while the
+// simulation keeps running. This way the memory used by a simulation
+// doesn't depend on step_cutoff, and long trajectories get written
+// as they go. Without a sink, like in the pilot runs of the auto
+// solver, full chunks are dropped.
+//
+// The chunk is allocated on the first push_back and doubles until it
+// reaches chunk_size. If pool is set, the buffers come from it, and
+// whoever consumes the chunks is expected to put them back.
+struct History {
+    // 2^16 elements is 1 MiB
+    static constexpr unsigned long int chunk_size = 1 << 16;
+    static constexpr unsigned long int initial_chunk_size = 1 << 8;
+
+    std::vector<HistoryElement> chunk;
+
+    // called with a full chunk and the step of its first firing
+    std::function<void(std::vector<HistoryElement> &&, long int)> sink;
+    BufferPool<HistoryElement> *pool;
+
+    unsigned long int expected_length;
+    unsigned long int flushed_elements;
+    long int flushed_firings; // step of the first firing in chunk
+
+    History(unsigned long int expected_length = 0) :
+        pool (nullptr),
+        expected_length (expected_length),
+        flushed_elements (0),
+        flushed_firings (0) {};
+
+    // number of elements recorded, including flushed ones
+    unsigned long int size() { return flushed_elements + chunk.size(); };
+
+    void push_back(HistoryElement element) {
+        if (chunk.size() == chunk.capacity()) grow();
+        chunk.push_back(element);
+        if (chunk.size() == chunk_size) flush();
+    };
+
+    void grow();
+    void flush();
+
+    // start the history of a new trajectory. The previous chunk must
+    // have been taken out already.
+    void clear();
+};
+
+void History::grow() {
+    unsigned long int capacity = chunk.capacity() == 0
+        ? std::max(std::min(expected_length, chunk_size), initial_chunk_size)
+        : std::min(2 * chunk.capacity(), chunk_size);
+
+    if (pool) {
+        std::vector<HistoryElement> next = pool->get(capacity);
+        next.insert(next.end(), chunk.begin(), chunk.end());
+        pool->put(std::move(chunk));
+        chunk = std::move(next);
+    } else {
+        chunk.reserve(capacity);
+    }
+};
+
+void History::flush() {
+    unsigned long int elements = chunk.size();
+    long int firings = 0;
+    for (HistoryElement &element : chunk) firings += element.count;
+
+    if (sink) {
+        sink(std::move(chunk), flushed_firings);
+        chunk = std::vector<HistoryElement> ();
+    } else {
+        chunk.clear();
+    }
+
+    flushed_elements += elements;
+    flushed_firings += firings;
+};
+
+void History::clear() {
+    chunk = std::vector<HistoryElement> ();
+    flushed_elements = 0;
+    flushed_firings = 0;
+};
+
+// models which know an upper bound of the propensity sum which holds
+// in every state provide it as propensity_sum_bound, and Simulation
+// passes it on to solvers which can use it.
+template <typename Model, typename = void>
+struct has_propensity_sum_bound : std::false_type {};
+
+template <typename Model>
+struct has_propensity_sum_bound<
+    Model,
+    std::void_t<decltype(std::declval<Model &>().propensity_sum_bound)>>
+    : std::true_type {};
+
+// a Simulation can be reused for another seed with reset. It keeps
+// track of the state entries and reactions which a trajectory has
+// changed, and only sets those back, so starting a short trajectory
+// doesn't cost time proportional to the size of the model. If the
+// solver can't be reset (see is_resettable_solver), a new one is built
+// instead.
 template <typename Solver, typename Model>
 struct Simulation {
     Model &model;
     unsigned long int seed;
     std::vector<int> state;
     double time;
-    int step; // number of reactions which have occoured
+    long int step; // number of reactions which have occoured
     Solver solver;
-    std::vector<HistoryElement> history;
-    std::function<void(Update)> update_function;
+    History history;
+
+    // the propensity updates of a step are collected here and passed
+    // to the solver as a single batch
+    std::vector<Update> update_buffer;
 
+    // entries changed since the last reset, and flags so that each is
+    // only recorded once
+    std::vector<int> touched_state;
+    std::vector<bool> state_touched;
+    std::vector<int> touched_reactions;
+    std::vector<bool> reaction_touched;
+
+    // stops execute_steps early. Inactive unless started with a
+    // condition.
+    StoppingMonitor stopping;
 
     Simulation(Model &model,
                unsigned long int seed,
 
-               // step cutoff gets used here to set the history length
-               // we don't actually store it in the Simulation object
-               int step_cutoff) :
+               // step cutoff gets used here to size the first history
+               // chunk. We don't actually store it in the Simulation object
+               long int step_cutoff) :
         model (model),
         seed (seed),
         state (model.initial_state),
@@ -33,12 +159,28 @@ struct Simulation {
         step (0),
         solver (seed, std::ref(model.initial_propensities)),
         history (step_cutoff + 1),
-        update_function ([&] (Update update) {solver.update(update);})
-        {};
+        state_touched (state.size(), false),
+        reaction_touched (
+            is_resettable_solver<Solver>::value
+            ? model.initial_propensities.size() : 0,
+            false)
+        {
+            bound_solver();
+        };
 
 
     bool execute_step();
-    void execute_steps(int step_cutoff);
+    void execute_steps(long int step_cutoff);
+
+    // start a new trajectory with seed. The history has to have been
+    // taken out already.
+    void reset(unsigned long int new_seed);
+
+    void bound_solver() {
+        if constexpr (is_bounded_solver<Solver>::value &&
+                      has_propensity_sum_bound<Model>::value)
+            solver.set_propensity_bound(model.propensity_sum_bound);
+    };
 };
 
 
@@ -48,6 +190,13 @@ bool Simulation<Solver, Model>::execute_step() {
 
     if (! maybe_event) {
 
+        // nothing will ever happen again, but a time condition can
+        // still start to hold
+        if (stopping.active() &&
+            stopping.check_horizons(
+                time, std::numeric_limits<double>::infinity(), state))
+            time = stopping.first_passage_time;
+
         return false;
 
     } else {
@@ -55,35 +204,115 @@ bool Simulation<Solver, Model>::execute_step() {
         Event event = maybe_event.value();
         int next_reaction = event.index;
 
+        // stop at a time threshold before the event if the condition
+        // holds there
+        if (stopping.active() &&
+            stopping.check_horizons(time, time + event.dt, state)) {
+            time = stopping.first_passage_time;
+            return false;
+        }
+
         // update time
         time += event.dt;
 
         // record what happened
-        history[step] = HistoryElement {
+        history.push_back(HistoryElement {
             .reaction_id = next_reaction,
-            .time = time};
+            .time = time});
 
         // increment step
         step++;
 
+        int changed_state[4];
+        int old_values[4];
+        int number_of_changed_entries =
+            model.changed_state_entries(next_reaction, changed_state);
+
+        for (int k = 0; k < number_of_changed_entries; k++)
+            old_values[k] = state[changed_state[k]];
+
         // update state
         model.update_state(std::ref(state), next_reaction);
 
+        for (int k = 0; k < number_of_changed_entries; k++) {
+            int i = changed_state[k];
+            if (! state_touched[i]) {
+                state_touched[i] = true;
+                touched_state.push_back(i);
+            }
+
+            // an entry can appear twice, for example in A + A -> B
+            if (stopping.active()) {
+                bool repeated = false;
+                for (int m = 0; m < k; m++)
+                    if (changed_state[m] == i) repeated = true;
+
+                if (! repeated) stopping.record_change(old_values[k], state[i]);
+            }
+        }
 
         // update propensities
         model.update_propensities(
-            update_function,
+            [&] (Update update) {update_buffer.push_back(update);},
             std::ref(state),
             next_reaction);
 
+        if constexpr (is_resettable_solver<Solver>::value) {
+            for (Update &update : update_buffer) {
+                if (! reaction_touched[update.index]) {
+                    reaction_touched[update.index] = true;
+                    touched_reactions.push_back(update.index);
+                }
+            }
+        }
+
+        solver.update(update_buffer);
+        update_buffer.clear();
+
         return true;
     }
 };
 
 template <typename Solver, typename Model>
-void Simulation<Solver, Model>::execute_steps(int step_cutoff) {
+void Simulation<Solver, Model>::execute_steps(long int step_cutoff) {
+    if (stopping.check(time, state)) return;
+
     while(execute_step()) {
         if (step > step_cutoff)
             break;
+
+        if (stopping.check(time, state))
+            break;
+    }
+};
+
+template <typename Solver, typename Model>
+void Simulation<Solver, Model>::reset(unsigned long int new_seed) {
+    seed = new_seed;
+    time = 0.0;
+    step = 0;
+    history.clear();
+
+    for (int i : touched_state) {
+        state[i] = model.initial_state[i];
+        state_touched[i] = false;
+    }
+    touched_state.clear();
+
+    if constexpr (is_resettable_solver<Solver>::value) {
+        for (int j : touched_reactions) {
+            update_buffer.push_back(Update {
+                    .index = (unsigned long int) j,
+                    .propensity = model.initial_propensities[j]});
+            reaction_touched[j] = false;
+        }
+        touched_reactions.clear();
+
+        solver.update(update_buffer);
+        update_buffer.clear();
+        solver.reseed(seed);
+    } else {
+        solver = Solver(seed, std::ref(model.initial_propensities));
+        bound_solver();
     }
 };
@@ -0,0 +1,214 @@
+#pragma once
+#include <chrono>
+#include <string>
+#include "dispatcher.h"
+#include "rejection_simulation.h"
+
+// the solver is a template parameter of the dispatcher, so that the
+// simulation loop gets compiled (and inlined) for each solver
+// separately. Here we instantiate a dispatcher for every solver ahead
+// of time and select one at runtime by name, which means we can
+// benchmark solvers on a network without recompiling.
+//
+// The best solver depends on the size and sparsity of the network, so
+// we also provide an "auto" mode, which runs a short timed pilot of
+// every solver on the loaded model and picks the fastest. Since the
+// pilot is timed, auto mode is not reproducible across runs. Use an
+// explicit solver name if you need bit for bit reproducibility.
+// Entries which don't sample the exact distribution, or only exist for
+// debugging, are never picked by auto mode, and neither are entries which don't support stopping
+// conditions if one is given.
+
+template <
+    typename Solver,
+    template <typename, typename> class SimulationType = Simulation,
+    bool is_exact = true>
+struct SolverEntry {
+    using solver = Solver;
+    static constexpr bool exact = is_exact;
+
+    template <typename S, typename M>
+    using simulation = SimulationType<S, M>;
+};
+
+// solvers which only work with a particular model. A model registers
+// them by specializing ModelSolvers and calling f(name, entry) for each
+// one in for_each.
+template <typename Model>
+struct ModelSolvers {
+    template <typename F>
+    static void for_each(F) {};
+};
+
+// calls f(name, entry) for every solver which works with Model.
+template <typename Model, typename F>
+void for_each_solver(F f) {
+    f("linear", SolverEntry<LinearSolver>());
+    f("tree", SolverEntry<TreeSolver>());
+    f("composition_rejection", SolverEntry<CompositionRejectionSolver>());
+    f("next_reaction", SolverEntry<NextReactionSolver>());
+    f("wide_tree", SolverEntry<WideTreeSolver<8>>());
+    f("wide_tree_16", SolverEntry<WideTreeSolver<16>>());
+    f("fenwick", SolverEntry<FenwickSolver>());
+    f("alias", SolverEntry<AliasSolver>());
+    f("sorting_linear", SolverEntry<SortingLinearSolver>());
+    f("mixed_precision_tree", SolverEntry<MixedPrecisionTreeSolver>());
+    f("mixed_precision_tree_check",
+      SolverEntry<CheckedMixedPrecisionTreeSolver, Simulation, false>());
+    f("uniformization", SolverEntry<UniformizationSolver>());
+    f("rejection", SolverEntry<TreeSolver, RejectionSimulation>());
+    ModelSolvers<Model>::for_each(f);
+}
+
+template <typename Model>
+std::string solver_names() {
+    std::string names = "auto";
+    for_each_solver<Model>([&](std::string name, auto) { names += "|" + name; });
+    return names;
+}
+
+// run each solver for at most pilot_steps steps or pilot_time seconds
+// and return the name of the one which did the most steps per second,
+// including the time spent setting up each trajectory.
+template <typename Model, typename Parameters>
+std::string select_solver(
+    std::string model_database_file,
+    std::string initial_state_database_file,
+    unsigned long int base_seed,
+    long int step_cutoff,
+    Parameters parameters,
+    bool needs_stopping) {
+
+    constexpr int pilot_steps = 20000;
+    constexpr double pilot_time = 0.5;
+
+    SqlConnection model_database (
+        model_database_file,
+        SQLITE_OPEN_READONLY);
+
+    SqlConnection initial_state_database (
+        initial_state_database_file,
+        SQLITE_OPEN_READONLY);
+
+    Model model (model_database, initial_state_database, parameters);
+
+    // returns steps per second for a single solver
+    auto pilot = [&](auto entry) {
+        using Entry = decltype(entry);
+        using Clock = std::chrono::steady_clock;
+
+        long int cutoff = std::min(step_cutoff, (long int) pilot_steps);
+        long int steps = 0;
+        unsigned long int seed = base_seed;
+        auto start = Clock::now();
+        double elapsed = 0.0;
+
+        while (steps < pilot_steps && elapsed < pilot_time) {
+            typename Entry::template simulation<typename Entry::solver, Model>
+                simulation (model, seed, cutoff);
+
+            while (simulation.step <= cutoff && simulation.execute_step()) {
+                if (simulation.step % 64 == 0) {
+                    elapsed = std::chrono::duration<double>(
+                        Clock::now() - start).count();
+                    if (elapsed >= pilot_time) break;
+                }
+            }
+
+            steps += simulation.step;
+            seed++;
+            elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+        }
+
+        return steps / elapsed;
+    };
+
+    // models can build caches lazily (for example the GMC dependency
+    // graph), so we do one untimed run first. Otherwise the first
+    // solver would pay for filling them.
+    pilot(SolverEntry<LinearSolver>());
+
+    std::string best_name;
+    double best_rate = -1.0;
+
+    for_each_solver<Model>([&](std::string name, auto entry) {
+        using Entry = decltype(entry);
+        using Simulation =
+            typename Entry::template simulation<typename Entry::solver, Model>;
+
+        if (! Entry::exact) return;
+        if (needs_stopping && ! has_stopping_monitor<Simulation>::value) return;
+
+        double rate = pilot(entry);
+        std::cerr << time_stamp()
+                  << "pilot: " << name << " "
+                  << rate << " steps per second\n";
+
+        if (rate > best_rate) {
+            best_rate = rate;
+            best_name = name;
+        }
+    });
+
+    std::cerr << time_stamp()
+              << "selected solver " << best_name << '\n';
+
+    return best_name;
+}
+
+// construct and run the dispatcher for the named solver. Returns false
+// if there is no solver with that name.
+template <
+    typename Model,
+    typename Parameters,
+    typename TrajectoriesSql>
+bool run_dispatcher(
+    std::string solver_name,
+    std::string model_database_file,
+    std::string initial_state_database_file,
+    unsigned long int number_of_simulations,
+    unsigned long int base_seed,
+    int number_of_threads,
+    long int step_cutoff,
+    Parameters parameters,
+    StoppingCondition stopping_condition) {
+
+    if (solver_name == "auto")
+        solver_name = select_solver<Model>(
+            model_database_file,
+            initial_state_database_file,
+            base_seed,
+            step_cutoff,
+            parameters,
+            ! stopping_condition.empty());
+
+    bool found = false;
+    for_each_solver<Model>([&](std::string name, auto entry) {
+        using Entry = decltype(entry);
+        if (found || name != solver_name) return;
+        found = true;
+
+        Dispatcher<
+            typename Entry::solver,
+            Model,
+            Parameters,
+            TrajectoriesSql,
+            Entry::template simulation
+            >
+
+            dispatcher (
+                model_database_file,
+                initial_state_database_file,
+                number_of_simulations,
+                base_seed,
+                number_of_threads,
+                step_cutoff,
+                parameters,
+                stopping_condition
+                );
+
+        dispatcher.run_dispatcher();
+    });
+
+    return found;
+}
@@ -3,11 +3,36 @@
 #include <vector>
 #include <optional>
 #include <cmath>
+#include <limits>
+#include <utility>
+#include <algorithm>
+#include <iostream>
+#include <sstream>
+#include <unordered_map>
+#include <type_traits>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
 
 // the solver is the algorithmic backbone of a monte carlo simulation
 // it decides what will occour next.  for now, we have the linear
 // solver and a tree solver ported from spparks:
 // https://spparks.sandia.gov/
+// a composition rejection solver as described in
+// https://doi.org/10.1063/1.2919546
+// the next reaction method of Gibson and Bruck:
+// https://doi.org/10.1021/jp993732q
+// a wide version of the tree solver which stores the children of
+// a node contiguously in a cache line and a solver based on a
+// Fenwick tree: https://doi.org/10.1002/spe.4380240306
+// a solver which samples from a Walker alias table:
+// https://doi.org/10.1109/32.92917
+// the sorting direct method:
+// https://doi.org/10.1016/j.compbiolchem.2005.10.007
+// a solver which groups indices with identical propensities,
+// a version of the tree solver which stores the leaves in single
+// precision, with a debug mode which checks it against the double
+// precision tree, and a solver based on uniformization.
 
 struct Update {
     unsigned long int index;
@@ -19,6 +44,37 @@ struct Event {
     double dt;
 };
 
+// solvers which are in the same state as a new solver once every
+// changed propensity has been set back and they have been reseeded
+// provide reseed. Simulations use it to reuse a solver between
+// trajectories instead of building a new one.
+template <typename Solver, typename = void>
+struct is_resettable_solver : std::false_type {};
+
+template <typename Solver>
+struct is_resettable_solver<
+    Solver,
+    std::void_t<decltype(std::declval<Solver &>().reseed(0ul))>>
+    : std::true_type {};
+
+// solvers which sample against an upper bound of the propensity sum
+// provide set_propensity_bound, so that models which know a bound
+// which holds in every state can pass it on. See Simulation.
+template <typename Solver, typename = void>
+struct is_bounded_solver : std::false_type {};
+
+template <typename Solver>
+struct is_bounded_solver<
+    Solver,
+    std::void_t<decltype(std::declval<Solver &>().set_propensity_bound(0.0))>>
+    : std::true_type {};
+
+// every solver also accepts a batch of updates, which is how the
+// simulation passes the updates of a single step. A batch can contain
+// duplicate indices and propensities which haven't changed. Both are
+// skipped, and the tree solvers recompute each internal node on the
+// paths from the changed leaves to the root once per batch.
+
 class LinearSolver {
 private:
     Sampler sampler;
@@ -33,34 +89,498 @@ public:
     LinearSolver(unsigned long int seed, std::vector<double> &&initial_propensities);
     LinearSolver(unsigned long int seed, std::vector<double> &initial_propensities);
     void update(Update update);
-    void update(std::vector<Update> updates);
+    void update(std::vector<Update> &updates);
     std::optional<Event> event();
     double get_propensity(int index);
     double get_propensity_sum();
 };
 
 
+// binary tree of partial sums, shared by the solvers which sample an
+// index by walking from the root to a leaf. The internal nodes are
+// stored as a binary heap of doubles, and leaf i is node offset + i.
+// The leaves are kept in a separate array of type Leaf, so that they
+// can be stored in lower precision than the sums. There is always at
+// least one internal node, so the children of the lowest internal
+// level are leaves.
+template <typename Leaf>
+struct SumTree {
+    std::vector<double> nodes; // internal nodes
+    std::vector<Leaf> leaves;
+    int offset; // node index of leaf 0, and number of internal nodes
+    std::vector<int> dirty_nodes; // scratch space for batched updates
+
+    SumTree(unsigned long int number_of_leaves);
+
+    double sum() { return nodes[0]; };
+
+    double node_value(int node) {
+        if (node < offset) return nodes[node];
+        else return leaves[node - offset];
+    };
+
+    // recompute every internal node from the leaves
+    void build();
+
+    // set a leaf and recompute the internal nodes above it
+    void set(unsigned long int index, Leaf leaf);
+
+    // set a leaf and leave the internal nodes above it to propagate,
+    // which recomputes every internal node on the paths from the
+    // staged leaves to the root once
+    void stage(unsigned long int index, Leaf leaf);
+    void propagate();
+
+    // walk from the root to the leaf where the partial sums of the
+    // leaves pass value. Rounding can push value past the last nonzero
+    // subtree, so we never descend into a subtree with zero sum.
+    unsigned long int find(double value);
+};
+
+
 class TreeSolver {
 private:
     Sampler sampler;
-    std::vector<double> tree; // we store the propensities in a binary heap
-    int number_of_indices; // for this solver, different to length of tree
+    SumTree<double> tree; // the propensities are the leaves
+    int number_of_indices;
     int number_of_active_indices; // an index is active if its propensity is non zero
-    int propensity_offset; // index where propensities start as leaves of tree
-
-    // walk tree from root to appropriate leaf
-    // value is modified when right branch of tree is traversed
-    int find_solve_tree(double value);
 
 public:
     // tree solver is constructed using a reference because it ends up
     // forming the tail end of a larger vector
     TreeSolver(unsigned long int seed, std::vector<double> &initial_propensities);
     void update(Update update);
-    void update(std::vector<Update> updates);
+    void update(std::vector<Update> &updates);
+    std::optional<Event> event();
+    double get_propensity(int index);
+    double get_propensity_sum();
+
+    // internal nodes only depend on the leaves, so after setting the
+    // changed propensities back and reseeding, the solver is the same
+    // as a new one.
+    void reseed(unsigned long int seed);
+};
+
+
+// propensities are grouped by their binary exponent, so all the
+// propensities in a group are within a factor of 2 of each other.
+// A group is chosen by a linear search over the nonempty groups (of
+// which there are only as many as the dynamic range of the
+// propensities in bits) and then a member of the group is chosen by
+// rejection sampling against the upper bound of the group, which
+// succeeds with probability at least 1/2. Both sampling and updating
+// are constant time, independent of the number of reactions.
+class CompositionRejectionSolver {
+private:
+    struct Group {
+        std::vector<unsigned long int> members;
+        double propensity_sum;
+        double upper_bound; // every member propensity is < upper_bound
+    };
+
+    Sampler sampler;
+    std::vector<double> propensities;
+    std::vector<Group> groups; // indexed by binary exponent - min_exponent
+    std::vector<int> group_index; // group of each index, -1 if inactive
+    std::vector<unsigned long int> member_position; // position in group members
+    std::vector<int> active_groups; // groups with at least one member
+    std::vector<int> active_group_position; // position in active_groups
+    int number_of_active_indices;
+
+    // smallest exponent returned by frexp for a positive double
+    static constexpr int min_exponent =
+        std::numeric_limits<double>::min_exponent
+        - std::numeric_limits<double>::digits + 1;
+
+    static constexpr int number_of_groups =
+        std::numeric_limits<double>::max_exponent - min_exponent + 1;
+
+    int find_group(double propensity);
+    void insert(unsigned long int index, double propensity);
+    void remove(unsigned long int index);
+
+public:
+    CompositionRejectionSolver(unsigned long int seed, std::vector<double> &initial_propensities);
+    void update(Update update);
+    void update(std::vector<Update> &updates);
+    std::optional<Event> event();
+    double get_propensity(int index);
+    double get_propensity_sum();
+};
+
+
+// every index with nonzero propensity has a putative firing time and
+// the indices are kept in a binary heap ordered by firing time. The
+// next event is the top of the heap. When a propensity changes, the
+// remaining waiting time is rescaled instead of being redrawn, so
+// only one random number is used per step, and only the indices which
+// are passed to update are touched. The firing time is absolute, so
+// dt is the difference between consecutive firing times.
+class NextReactionSolver {
+private:
+    Sampler sampler;
+    std::vector<double> propensities;
+    std::vector<double> firing_times; // infinity if propensity is zero
+
+    // when a propensity drops to zero, the remaining waiting time
+    // (scaled to unit rate) is stored here and reused when it becomes
+    // nonzero again. Negative if no waiting time has been drawn yet.
+    std::vector<double> unit_rate_remaining;
+
+    std::vector<unsigned long int> heap; // heap of indices by firing time
+    std::vector<unsigned long int> heap_position; // position of index in heap
+    double time; // firing time of the last event
+    int number_of_active_indices;
+    double propensity_sum;
+
+    void swap_heap_nodes(unsigned long int a, unsigned long int b);
+    void sift(unsigned long int position);
+
+public:
+    NextReactionSolver(unsigned long int seed, std::vector<double> &initial_propensities);
+    void update(Update update);
+    void update(std::vector<Update> &updates);
+    std::optional<Event> event();
+    double get_propensity(int index);
+    double get_propensity_sum();
+};
+
+
+// TreeSolver does one dependent load per level of a binary tree, so
+// once the tree no longer fits in cache every level is a cache
+// miss. WideTreeSolver stores the children of each node contiguously
+// in an aligned block of width doubles (width = 8 is exactly one 64
+// byte cache line), which cuts the depth of the tree by a factor of
+// log2(width). The child containing a value is found by a prefix sum
+// over the block followed by a vector compare. Blocks are only
+// allocated for the indices which exist, so there is no padding up to
+// a power of two. TreeSolver is still available for comparison.
+template <int width>
+class WideTreeSolver {
+private:
+    static_assert(width % 4 == 0, "width must be a multiple of 4");
+
+    struct alignas(64) Block {
+        double values[width];
+    };
+
+    Sampler sampler;
+
+    // levels[0] stores the propensities. Entry j of levels[l+1] (that
+    // is levels[l+1][j / width].values[j % width]) is the sum of block
+    // j of levels[l]. The last level is a single block.
+    std::vector<std::vector<Block>> levels;
+    int number_of_indices;
+    int number_of_active_indices;
+    double propensity_sum;
+    std::vector<unsigned long int> dirty_blocks; // scratch space for batched updates
+
+    // inclusive prefix sums of a block. The summation order is fixed,
+    // so the scalar and vector versions agree bit for bit, which keeps
+    // simulations reproducible across machines.
+    static void prefix_sums(const Block &block, double prefix[width]);
+
+    // choose the child of a block containing value and subtract the
+    // propensity of the preceeding children from value.
+    static int find_child(const Block &block, double &value);
+
+    int find_solve_tree(double value);
+
+public:
+    WideTreeSolver(unsigned long int seed, std::vector<double> &initial_propensities);
+    void update(Update update);
+    void update(std::vector<Update> &updates);
+    std::optional<Event> event();
+    double get_propensity(int index);
+    double get_propensity_sum();
+};
+
+
+// TreeSolver rounds the number of indices up to a power of two and
+// allocates 2 * pow2 - 1 doubles, which is almost 4x the number of
+// indices just above a power of two. FenwickSolver uses a binary
+// indexed tree which stores exactly one double per index, plus one bit
+// per index recording whether it is active. Updates add the change in
+// propensity to the log2(R) nodes covering the index and the event is
+// found by a binary descent, so both are O(log R).
+//
+// Since the tree only stores partial sums, propensities are changed by
+// adding differences, and rounding errors accumulate. To keep them
+// bounded, the tree is rebuilt from scratch (in place, in O(R)) after
+// every R updates, zeroing the inactive indices exactly.
+class FenwickSolver {
+private:
+    Sampler sampler;
+
+    // 1-based fenwick tree stored at offset 0. tree[i - 1] is the sum
+    // of the propensities with 1-based index in (i - lowbit(i), i].
+    std::vector<double> tree;
+    std::vector<bool> active; // exact record of nonzero propensities
+    unsigned long int number_of_indices;
+    int number_of_active_indices;
+    unsigned long int highest_power_of_two; // largest power of 2 <= number_of_indices
+    unsigned long int updates_since_rebuild;
+
+    static unsigned long int lowbit(unsigned long int i) { return i & (~i + 1); };
+
+    // convert the propensities stored in tree into a fenwick tree in place
+    void build();
+
+    // convert the fenwick tree back into the propensities, zero the
+    // inactive indices and rebuild
+    void rebuild();
+
+    // sum of the propensities with index < i
+    double prefix_sum(unsigned long int i);
+    int find_solve_tree(double value);
+
+public:
+    FenwickSolver(unsigned long int seed, std::vector<double> &initial_propensities);
+    void update(Update update);
+    void update(std::vector<Update> &updates);
+    std::optional<Event> event();
+    double get_propensity(int index);
+    double get_propensity_sum();
+};
+
+
+// when only a handful of propensities change per step, we can sample
+// from an alias table built from a snapshot of the propensities in
+// O(1) and correct for the changes since the snapshot with rejection:
+// an index drawn from the table is accepted with probability
+// min(p, p_table) / p_table and the excess max(p - p_table, 0) of the
+// indices whose propensity has grown is kept in a small side list
+// which is sampled linearly. The table only covers the indices which
+// were active when it was built, and it is only rebuilt once the side
+// list gets long or the expected number of rejections gets large, so
+// the rebuild cost is amortized over many steps.
+class AliasSolver {
+private:
+    Sampler sampler;
+    std::vector<double> propensities;
+    double propensity_sum;
+
+    // indices with nonzero propensity
+    std::vector<unsigned long int> active_indices;
+    std::vector<long int> active_position; // -1 if not in active_indices
+
+    // alias table over the slots of table_indices, built from
+    // table_propensities. table_propensities is zero for indices
+    // which are not in the table.
+    std::vector<unsigned long int> table_indices;
+    std::vector<double> table_propensities;
+    std::vector<double> alias_probability;
+    std::vector<unsigned long int> alias;
+    double table_propensity_sum;
+
+    // indices with propensity greater than their table propensity
+    std::vector<unsigned long int> excess_indices;
+    std::vector<long int> excess_position; // -1 if not in excess_indices
+
+    // scratch space for building the table
+    std::vector<unsigned long int> small;
+    std::vector<unsigned long int> large;
+
+    // rebuild once sampling proposes more than rebuild_factor times
+    // the true propensity sum, or the side list has more than
+    // max_excess_indices entries
+    static constexpr double rebuild_factor = 2.0;
+    static constexpr unsigned long int min_excess_indices = 16;
+
+    void build_table();
+    double excess(unsigned long int index);
+
+    // insert or remove index from a list with O(1) position lookup
+    static void list_insert(
+        std::vector<unsigned long int> &list,
+        std::vector<long int> &position,
+        unsigned long int index);
+
+    static void list_remove(
+        std::vector<unsigned long int> &list,
+        std::vector<long int> &position,
+        unsigned long int index);
+
+public:
+    AliasSolver(unsigned long int seed, std::vector<double> &initial_propensities);
+    void update(Update update);
+    void update(std::vector<Update> &updates);
+    std::optional<Event> event();
+    double get_propensity(int index);
+    double get_propensity_sum();
+};
+
+
+// LinearSolver scans every propensity from index 0, including the
+// zero ones. SortingLinearSolver keeps only the nonzero propensities,
+// packed into a dense array with the position of each index tracked
+// so inserting and removing are O(1). Each time an index fires, it is
+// swapped one place towards the front of the array, so frequently
+// firing indices end up at the front and the linear scan usually
+// terminates after a few elements.
+class SortingLinearSolver {
+private:
+    Sampler sampler;
+    std::vector<double> propensities; // nonzero propensities in search order
+    std::vector<unsigned long int> indices; // index of each entry of propensities
+    std::vector<long int> position; // position of index in propensities, -1 if zero
+    double propensity_sum;
+
+public:
+    SortingLinearSolver(unsigned long int seed, std::vector<double> &initial_propensities);
+    void update(Update update);
+    void update(std::vector<Update> &updates);
+    std::optional<Event> event();
+    double get_propensity(int index);
+    double get_propensity_sum();
+};
+
+
+// in NPMC, a nonzero propensity is always rate * factor for the
+// reaction, and many reactions share a rate because they have the
+// same interaction and either no distance dependence or equal
+// distances on a lattice. EqualRateSolver groups the active indices
+// into classes of bit identical propensity, each holding a dense list
+// of members with O(1) insert and remove. A class is sampled with
+// weight count * propensity by a linear scan, and then a member is
+// picked uniformly, so the cost of an event scales with the number of
+// distinct propensities rather than the number of reactions. Classes
+// are created whenever a propensity appears which doesn't have one,
+// and removed once their last member leaves, so the scan only covers
+// the propensities which are currently active. Removed classes stay at
+// the end of classes, so that their member lists can be reused without
+// allocating. Since an NPMC propensity is either zero or the rate of
+// the reaction times a constant factor, the classes are the distinct
+// reaction rates, and this solver is only offered for NPMC.
+class EqualRateSolver {
+private:
+    struct RateClass {
+        double propensity;
+        std::vector<unsigned long int> members;
+    };
+
+    Sampler sampler;
+    std::vector<RateClass> classes;
+    unsigned long int number_of_classes; // classes past this are unused
+    std::unordered_map<double, int> class_of_propensity;
+    std::vector<int> class_index; // class of each index, -1 if inactive
+    std::vector<unsigned long int> member_position; // position in class members
+    int number_of_active_indices;
+    double propensity_sum;
+
+    int find_class(double propensity);
+    void remove_class(int c);
+
+public:
+    EqualRateSolver(unsigned long int seed, std::vector<double> &initial_propensities);
+    void update(Update update);
+    void update(std::vector<Update> &updates);
+    std::optional<Event> event();
+    double get_propensity(int index);
+    double get_propensity_sum();
+};
+
+
+// same as TreeSolver, but the leaves are stored as floats while the
+// internal sums stay doubles. For large networks the leaves are most
+// of the memory traffic, so this halves it, at the cost of rounding
+// each propensity to 24 significant bits. Propensities must fit in
+// the range of a float. Nonzero propensities below it are rounded up
+// to the smallest positive float so they stay active.
+class MixedPrecisionTreeSolver {
+private:
+    Sampler sampler;
+    SumTree<float> tree;
+    int number_of_indices;
+    int number_of_active_indices;
+
+    static float to_leaf(double propensity);
+    void count_leaf(unsigned long int index, float leaf);
+
+public:
+    MixedPrecisionTreeSolver(unsigned long int seed, std::vector<double> &initial_propensities);
+    void update(Update update);
+    void update(std::vector<Update> &updates);
+    std::optional<Event> event();
+    double get_propensity(int index);
+    double get_propensity_sum();
+};
+
+
+// debug mode for MixedPrecisionTreeSolver. It drives a TreeSolver with
+// the same seed through the same updates, so both draw the same random
+// numbers, and writes every event where the two select different
+// indices to stderr, along with both propensity sums. The events of
+// the mixed precision tree are the ones which are returned. A few
+// disagreements are expected when rounding moves a boundary between
+// leaves, but they should be a tiny fraction of the events.
+class CheckedMixedPrecisionTreeSolver {
+private:
+    MixedPrecisionTreeSolver solver;
+    TreeSolver reference_solver;
+    unsigned long int number_of_events;
+    unsigned long int number_of_disagreements;
+
+public:
+    CheckedMixedPrecisionTreeSolver(unsigned long int seed, std::vector<double> &initial_propensities);
+    void update(Update update);
+    void update(std::vector<Update> &updates);
+    std::optional<Event> event();
+    double get_propensity(int index);
+    double get_propensity_sum();
+};
+
+
+// uniformization: candidate events arrive as a Poisson process with a
+// bounding rate which is at least the propensity sum, and a candidate
+// is accepted with probability propensity_sum / bound, in which case
+// the index is chosen from a binary tree over the propensities like
+// in TreeSolver. Rejected candidates are skipped inside event, so the
+// simulation never sees them. Candidates are generated window_size at
+// a time. Their times are the partial sums of exponential spacings
+// with rate bound, so they come out in order without sorting, and the
+// spacings, acceptance variates and partial sums are each computed in
+// a separate loop over the window.
+//
+// Events are still returned one at a time, like the other solvers.
+// Nothing here records the state on a fixed time grid.
+//
+// Since the propensities don't change between events, the bound can
+// change at any event. It is set to bound_headroom times the
+// propensity sum whenever the sum leaves [bound / 4, bound], and the
+// candidates which haven't been used yet are dropped, so at least a
+// quarter of the candidates are accepted. If the model bounds the
+// propensity sum in every state (see set_propensity_bound), the bound
+// is never set above that, so a model whose sum stays close to its
+// bound samples candidates at a fixed rate.
+class UniformizationSolver {
+private:
+    Sampler sampler;
+    SumTree<double> tree;
+    int number_of_indices;
+    int number_of_active_indices;
+
+    double bound;
+    double model_bound; // bound on the propensity sum in every state
+    double time; // time of the last event
+    double window_end; // time of the last generated candidate
+    std::vector<double> candidate_times;
+    std::vector<double> acceptances;
+    unsigned long int next_candidate;
+
+    static constexpr unsigned long int window_size = 64;
+    static constexpr double bound_headroom = 2.0;
+
+    void generate_window();
+
+public:
+    UniformizationSolver(unsigned long int seed, std::vector<double> &initial_propensities);
+    void update(Update update);
+    void update(std::vector<Update> &updates);
     std::optional<Event> event();
     double get_propensity(int index);
     double get_propensity_sum();
+    void set_propensity_bound(double propensity_bound);
 };
 
 
@@ -109,20 +629,19 @@ void LinearSolver::update(Update update) {
     propensities[update.index] = update.propensity;
 };
 
-void LinearSolver::update(std::vector<Update> updates) {
-    for (Update u : updates) {
-        update(u);
-    }
-};
+void LinearSolver::update(std::vector<Update> &updates) {
+    for (Update u : updates)
+        if (get_propensity(u.index) != u.propensity) update(u);
+}
 
 std::optional<Event> LinearSolver::event() {
     if (number_of_active_indices == 0) {
-        propensity_sum = 0.0;
         return std::optional<Event>();
     }
 
+    double propensity_sum = get_propensity_sum();
     double r1 = sampler.generate();
-    double r2 = sampler.generate();
+    double r2 = sampler.exponential();
     double fraction = propensity_sum * r1;
     double partial = 0.0;
 
@@ -133,7 +652,7 @@ std::optional<Event> LinearSolver::event() {
         if (partial > fraction) break;
     }
 
-    double dt = - std::log(r2) / propensity_sum;
+    double dt = r2 / propensity_sum;
     if (m < propensities.size())
         return std::optional<Event> (Event {.index = m, .dt = dt});
     else
@@ -149,78 +668,123 @@ double LinearSolver::get_propensity_sum() {
 }
 
 
+// SumTree implementation
+template <typename Leaf>
+SumTree<Leaf>::SumTree(unsigned long int number_of_leaves) {
+    unsigned long int pow2 = 2; // power of 2 >= number_of_leaves, and at least 2
+    while (pow2 < number_of_leaves) pow2 *= 2;
+
+    offset = pow2 - 1;
+    nodes.resize(offset, 0.0);
+    leaves.resize(pow2, 0);
+};
+
+template <typename Leaf>
+void SumTree<Leaf>::build() {
+    for (int parent = offset - 1; parent >= 0; parent--)
+        nodes[parent] = node_value(2 * parent + 1) + node_value(2 * parent + 2);
+};
+
+template <typename Leaf>
+void SumTree<Leaf>::set(unsigned long int index, Leaf leaf) {
+    leaves[index] = leaf;
+
+    int i = offset + index;
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        nodes[parent] = node_value(2 * parent + 1) + node_value(2 * parent + 2);
+        i = parent;
+    }
+};
+
+template <typename Leaf>
+void SumTree<Leaf>::stage(unsigned long int index, Leaf leaf) {
+    leaves[index] = leaf;
+    dirty_nodes.push_back(offset + index);
+};
+
+template <typename Leaf>
+void SumTree<Leaf>::propagate() {
+    // all the leaves are on the same level, so we can sweep up the
+    // tree one level at a time. Mapping a sorted list of nodes to
+    // their parents keeps it sorted, so shared parents are adjacent.
+    std::sort(dirty_nodes.begin(), dirty_nodes.end());
+    while (! dirty_nodes.empty() && dirty_nodes[0] > 0) {
+        unsigned long int number_of_parents = 0;
+        for (unsigned long int k = 0; k < dirty_nodes.size(); k++) {
+            int parent = (dirty_nodes[k] - 1) / 2;
+            if (number_of_parents > 0 &&
+                dirty_nodes[number_of_parents - 1] == parent)
+                continue;
+
+            nodes[parent] = node_value(2 * parent + 1) + node_value(2 * parent + 2);
+            dirty_nodes[number_of_parents] = parent;
+            number_of_parents++;
+        }
+        dirty_nodes.resize(number_of_parents);
+    }
+
+    dirty_nodes.clear();
+};
+
+template <typename Leaf>
+unsigned long int SumTree<Leaf>::find(double value) {
+    // descend through the internal levels, and then choose between
+    // the two leaves below the last internal node
+    int i = 0;
+    while (2 * i + 1 < offset) {
+        int left_child = 2 * i + 1;
+        if (value <= nodes[left_child] || nodes[left_child + 1] == 0.0)
+            i = left_child;
+        else {
+            value -= nodes[left_child];
+            i = left_child + 1;
+        }
+    }
+
+    unsigned long int left_leaf = 2 * i + 1 - offset;
+    if (value <= leaves[left_leaf] || leaves[left_leaf + 1] == 0)
+        return left_leaf;
+    else return left_leaf + 1;
+};
+
+
+
 // TreeSolver implementation
 // TreeSolver always copies the initial propensities into a new array.
 TreeSolver::TreeSolver(
     unsigned long int seed,
     std::vector<double> &initial_propensities) :
     sampler (Sampler(seed)),
+    tree (initial_propensities.size()),
+    number_of_indices (initial_propensities.size()),
     number_of_active_indices (0) {
-        int m = 0; // tree depth
-        int pow2 = 1; // power of 2 >= numberOfReactions
-        number_of_indices = initial_propensities.size();
-
-        while (pow2 < number_of_indices) {
-            pow2 *= 2;
-            m++;
-        };
-
-        int number_of_tree_nodes = 2 * pow2 - 1;
-        propensity_offset = pow2 - 1;
-        tree.resize(number_of_tree_nodes, 0.0);
-
-        for (int i = propensity_offset;
-             i < propensity_offset + number_of_indices;
-             i++) {
-            tree[i] = initial_propensities[i - propensity_offset];
-            if (tree[i] > 0.0) number_of_active_indices++;
 
+        for (int i = 0; i < number_of_indices; i++) {
+            tree.leaves[i] = initial_propensities[i];
+            if (initial_propensities[i] > 0.0) number_of_active_indices++;
         }
 
-        int child1, child2;
-        for (int parent = propensity_offset - 1; parent >= 0; parent--) {
-            child1 = 2 * parent + 1;
-            child2 = 2 * parent + 2;
-            tree[parent] = tree[child1] + tree[child2];
-        };
-
-
+        tree.build();
 };
 
 void TreeSolver::update(Update update) {
-    if (tree[propensity_offset + update.index] > 0.0) number_of_active_indices--;
+    if (tree.leaves[update.index] > 0.0) number_of_active_indices--;
     if (update.propensity > 0.0) number_of_active_indices++;
-    tree[propensity_offset + update.index] = update.propensity;
-
-    int parent, sibling;
-    int i = propensity_offset + update.index;
-
-    while (i > 0) {
-        if (i % 2) sibling = i + 1;
-        else sibling = i - 1;
-        parent = (i - 1) / 2;
-        tree[parent] = tree[i] + tree[sibling];
-        i = parent;
-    }
-}
-
-void TreeSolver::update(std::vector<Update> updates) {
-    for (Update u : updates)
-        update(u);
+    tree.set(update.index, update.propensity);
 }
 
-int TreeSolver::find_solve_tree(double value) {
-    int i, left_child;
-    i = 0;
-    while (i < propensity_offset) {
-        left_child = 2*i + 1;
-        if (value <= tree[left_child]) i = left_child;
-        else {
-            value -= tree[left_child];
-            i = left_child + 1;
-        }
+void TreeSolver::update(std::vector<Update> &updates) {
+    // set the changed leaves. Duplicates carry the same propensity,
+    // so skipping unchanged values also skips them.
+    for (Update u : updates) {
+        if (tree.leaves[u.index] == u.propensity) continue;
+        if (tree.leaves[u.index] > 0.0) number_of_active_indices--;
+        if (u.propensity > 0.0) number_of_active_indices++;
+        tree.stage(u.index, u.propensity);
     }
-    return i - propensity_offset;
+
+    tree.propagate();
 }
 
 std::optional<Event> TreeSolver::event() {
@@ -234,21 +798,1338 @@ std::optional<Event> TreeSolver::event() {
 
 
     r1 = sampler.generate();
-    r2 = sampler.generate();
+    r2 = sampler.exponential();
 
-    double value = r1 * tree[0];
+    double value = r1 * tree.sum();
 
-    m = find_solve_tree(value);
-    dt = - log(r2) / tree[0];
+    m = tree.find(value);
+    dt = r2 / tree.sum();
 
     return std::optional<Event>(Event {.index = m, .dt = dt});
 
 }
 
 double TreeSolver::get_propensity(int index) {
-    return tree[propensity_offset + index];
+    return tree.leaves[index];
 }
 
 double TreeSolver::get_propensity_sum() {
-    return tree[0];
+    return tree.sum();
+}
+
+void TreeSolver::reseed(unsigned long int seed) {
+    sampler.reseed(seed);
+}
+
+
+
+// CompositionRejectionSolver implementation
+// CompositionRejectionSolver copies the initial propensities.
+CompositionRejectionSolver::CompositionRejectionSolver(
+    unsigned long int seed,
+    std::vector<double> &initial_propensities) :
+    sampler (Sampler(seed)),
+    propensities (initial_propensities.size(), 0.0),
+    groups (number_of_groups),
+    group_index (initial_propensities.size(), -1),
+    member_position (initial_propensities.size(), 0),
+    active_groups (),
+    active_group_position (number_of_groups, -1),
+    number_of_active_indices (0) {
+
+        for (int g = 0; g < number_of_groups; g++) {
+            groups[g].propensity_sum = 0.0;
+            groups[g].upper_bound = std::ldexp(1.0, g + min_exponent);
+        }
+
+        for (unsigned long int i = 0; i < initial_propensities.size(); i++) {
+            propensities[i] = initial_propensities[i];
+            if (propensities[i] > 0.0) insert(i, propensities[i]);
+        }
+    };
+
+int CompositionRejectionSolver::find_group(double propensity) {
+    int exponent;
+    // propensity = mantissa * 2^exponent with 0.5 <= mantissa < 1
+    std::frexp(propensity, &exponent);
+    return exponent - min_exponent;
+}
+
+void CompositionRejectionSolver::insert(
+    unsigned long int index,
+    double propensity) {
+
+    int g = find_group(propensity);
+    Group &group = groups[g];
+
+    if (group.members.empty()) {
+        active_group_position[g] = active_groups.size();
+        active_groups.push_back(g);
+    }
+
+    group_index[index] = g;
+    member_position[index] = group.members.size();
+    group.members.push_back(index);
+    group.propensity_sum += propensity;
+    number_of_active_indices++;
+}
+
+void CompositionRejectionSolver::remove(unsigned long int index) {
+    int g = group_index[index];
+    Group &group = groups[g];
+
+    // move the last member into the vacated position
+    unsigned long int position = member_position[index];
+    unsigned long int last = group.members.back();
+    group.members[position] = last;
+    member_position[last] = position;
+    group.members.pop_back();
+    group.propensity_sum -= propensities[index];
+
+    if (group.members.empty()) {
+        // reset the sum so floating point error doesn't accumulate
+        // across the lifetime of the group
+        group.propensity_sum = 0.0;
+
+        int last_group = active_groups.back();
+        active_groups[active_group_position[g]] = last_group;
+        active_group_position[last_group] = active_group_position[g];
+        active_groups.pop_back();
+        active_group_position[g] = -1;
+    }
+
+    group_index[index] = -1;
+    number_of_active_indices--;
+}
+
+void CompositionRejectionSolver::update(Update update) {
+    double old_propensity = propensities[update.index];
+
+    if (old_propensity == update.propensity) return;
+
+    if (old_propensity > 0.0 &&
+        update.propensity > 0.0 &&
+        find_group(update.propensity) == group_index[update.index]) {
+
+        // index stays in the same group
+        groups[group_index[update.index]].propensity_sum +=
+            update.propensity - old_propensity;
+
+        propensities[update.index] = update.propensity;
+        return;
+    }
+
+    if (old_propensity > 0.0) remove(update.index);
+    propensities[update.index] = update.propensity;
+    if (update.propensity > 0.0) insert(update.index, update.propensity);
+}
+
+void CompositionRejectionSolver::update(std::vector<Update> &updates) {
+    for (Update u : updates)
+        if (get_propensity(u.index) != u.propensity) update(u);
+}
+
+std::optional<Event> CompositionRejectionSolver::event() {
+    if (number_of_active_indices == 0) {
+        return std::optional<Event>();
+    }
+
+    double propensity_sum = get_propensity_sum();
+    double r1 = sampler.generate();
+    double r2 = sampler.exponential();
+    double fraction = propensity_sum * r1;
+    double partial = 0.0;
+
+    // composition: choose a group
+    unsigned long int k;
+    for (k = 0; k < active_groups.size() - 1; k++) {
+        partial += groups[active_groups[k]].propensity_sum;
+        if (partial > fraction) break;
+    }
+
+    Group &group = groups[active_groups[k]];
+
+    // rejection: choose a member of the group. The integer part of
+    // r * size picks the candidate and the fractional part is used as
+    // the acceptance variate.
+    unsigned long int m;
+    while (true) {
+        double r = sampler.generate() * group.members.size();
+        unsigned long int position = r;
+        if (position >= group.members.size())
+            position = group.members.size() - 1;
+
+        m = group.members[position];
+        if ((r - position) * group.upper_bound < propensities[m]) break;
+    }
+
+    double dt = r2 / propensity_sum;
+    return std::optional<Event>(Event {.index = m, .dt = dt});
+}
+
+double CompositionRejectionSolver::get_propensity(int index) {
+    return propensities[index];
+}
+
+double CompositionRejectionSolver::get_propensity_sum() {
+    double propensity_sum = 0.0;
+    for (int g : active_groups)
+        propensity_sum += groups[g].propensity_sum;
+
+    return propensity_sum;
+}
+
+
+
+// NextReactionSolver implementation
+// NextReactionSolver copies the initial propensities.
+NextReactionSolver::NextReactionSolver(
+    unsigned long int seed,
+    std::vector<double> &initial_propensities) :
+    sampler (Sampler(seed)),
+    propensities (initial_propensities),
+    firing_times (initial_propensities.size(),
+                  std::numeric_limits<double>::infinity()),
+    unit_rate_remaining (initial_propensities.size(), -1.0),
+    heap (initial_propensities.size()),
+    heap_position (initial_propensities.size()),
+    time (0.0),
+    number_of_active_indices (0),
+    propensity_sum (0.0) {
+
+        for (unsigned long int i = 0; i < propensities.size(); i++) {
+            heap[i] = i;
+            heap_position[i] = i;
+            propensity_sum += propensities[i];
+            if (propensities[i] > 0.0) {
+                firing_times[i] = sampler.exponential() / propensities[i];
+                number_of_active_indices++;
+            }
+        }
+
+        // heapify
+        for (unsigned long int i = heap.size() / 2; i-- > 0;)
+            sift(i);
+    };
+
+void NextReactionSolver::swap_heap_nodes(
+    unsigned long int a,
+    unsigned long int b) {
+
+    std::swap(heap[a], heap[b]);
+    heap_position[heap[a]] = a;
+    heap_position[heap[b]] = b;
+}
+
+void NextReactionSolver::sift(unsigned long int position) {
+    // sift up
+    while (position > 0) {
+        unsigned long int parent = (position - 1) / 2;
+        if (firing_times[heap[position]] < firing_times[heap[parent]]) {
+            swap_heap_nodes(position, parent);
+            position = parent;
+        }
+        else break;
+    }
+
+    // sift down
+    while (true) {
+        unsigned long int smallest = position;
+        unsigned long int left_child = 2 * position + 1;
+        unsigned long int right_child = left_child + 1;
+
+        if (left_child < heap.size() &&
+            firing_times[heap[left_child]] < firing_times[heap[smallest]])
+            smallest = left_child;
+
+        if (right_child < heap.size() &&
+            firing_times[heap[right_child]] < firing_times[heap[smallest]])
+            smallest = right_child;
+
+        if (smallest == position) break;
+        swap_heap_nodes(position, smallest);
+        position = smallest;
+    }
+}
+
+void NextReactionSolver::update(Update update) {
+    unsigned long int i = update.index;
+    double old_propensity = propensities[i];
+
+    if (old_propensity == update.propensity) return;
+
+    if (old_propensity > 0.0 && update.propensity > 0.0) {
+        firing_times[i] = time +
+            (old_propensity / update.propensity) * (firing_times[i] - time);
+
+    } else if (old_propensity > 0.0) {
+        unit_rate_remaining[i] = old_propensity * (firing_times[i] - time);
+        firing_times[i] = std::numeric_limits<double>::infinity();
+        number_of_active_indices--;
+
+    } else {
+        if (unit_rate_remaining[i] < 0.0)
+            unit_rate_remaining[i] = sampler.exponential();
+
+        firing_times[i] = time + unit_rate_remaining[i] / update.propensity;
+        number_of_active_indices++;
+    }
+
+    propensity_sum += update.propensity - old_propensity;
+    propensities[i] = update.propensity;
+    sift(heap_position[i]);
+}
+
+void NextReactionSolver::update(std::vector<Update> &updates) {
+    for (Update u : updates)
+        if (get_propensity(u.index) != u.propensity) update(u);
+}
+
+std::optional<Event> NextReactionSolver::event() {
+    if (number_of_active_indices == 0) {
+        propensity_sum = 0.0;
+        return std::optional<Event>();
+    }
+
+    unsigned long int m = heap[0];
+    double dt = firing_times[m] - time;
+    time = firing_times[m];
+
+    // draw the next firing time of m with its current propensity. If
+    // the model updates the propensity of m, the waiting time gets
+    // rescaled which is equivalent to drawing a new one.
+    firing_times[m] = time + sampler.exponential() / propensities[m];
+    sift(0);
+
+    return std::optional<Event>(Event {.index = m, .dt = dt});
+}
+
+double NextReactionSolver::get_propensity(int index) {
+    return propensities[index];
+}
+
+double NextReactionSolver::get_propensity_sum() {
+    return propensity_sum;
+}
+
+
+
+// WideTreeSolver implementation
+// WideTreeSolver copies the initial propensities into the leaf blocks.
+template <int width>
+WideTreeSolver<width>::WideTreeSolver(
+    unsigned long int seed,
+    std::vector<double> &initial_propensities) :
+    sampler (Sampler(seed)),
+    levels (),
+    number_of_indices (initial_propensities.size()),
+    number_of_active_indices (0),
+    propensity_sum (0.0) {
+
+        // allocate levels until a single block remains
+        unsigned long int level_size = number_of_indices;
+        do {
+            unsigned long int number_of_blocks =
+                level_size == 0 ? 1 : (level_size + width - 1) / width;
+            levels.push_back(std::vector<Block> (number_of_blocks, Block {}));
+            level_size = number_of_blocks;
+        } while (level_size > 1);
+
+        for (int i = 0; i < number_of_indices; i++) {
+            levels[0][i / width].values[i % width] = initial_propensities[i];
+            if (initial_propensities[i] > 0.0) number_of_active_indices++;
+        }
+
+        double prefix[width];
+        for (unsigned long int l = 0; l + 1 < levels.size(); l++) {
+            for (unsigned long int j = 0; j < levels[l].size(); j++) {
+                prefix_sums(levels[l][j], prefix);
+                levels[l + 1][j / width].values[j % width] = prefix[width - 1];
+            }
+        }
+
+        prefix_sums(levels.back()[0], prefix);
+        propensity_sum = prefix[width - 1];
+    };
+
+template <int width>
+void WideTreeSolver<width>::prefix_sums(
+    const Block &block,
+    double prefix[width]) {
+
+    // each group of 4 is summed as
+    // x0, x0 + x1, x0 + (x1 + x2), (x0 + x1) + (x2 + x3)
+    // plus the total of the previous groups.
+
+#ifdef __AVX2__
+    __m256d zero = _mm256_setzero_pd();
+    __m256d carry = zero;
+    for (int k = 0; k < width; k += 4) {
+        __m256d x = _mm256_load_pd(block.values + k);
+        __m256d t = _mm256_permute4x64_pd(x, _MM_SHUFFLE(2, 1, 0, 0));
+        x = _mm256_add_pd(x, _mm256_blend_pd(t, zero, 0x1));
+        t = _mm256_permute4x64_pd(x, _MM_SHUFFLE(1, 0, 0, 0));
+        x = _mm256_add_pd(x, _mm256_blend_pd(t, zero, 0x3));
+        x = _mm256_add_pd(x, carry);
+        _mm256_storeu_pd(prefix + k, x);
+        carry = _mm256_permute4x64_pd(x, _MM_SHUFFLE(3, 3, 3, 3));
+    }
+#else
+    double carry = 0.0;
+    for (int k = 0; k < width; k += 4) {
+        const double *x = block.values + k;
+        double x01 = x[0] + x[1];
+        prefix[k] = x[0] + carry;
+        prefix[k + 1] = x01 + carry;
+        prefix[k + 2] = (x[0] + (x[1] + x[2])) + carry;
+        prefix[k + 3] = (x01 + (x[2] + x[3])) + carry;
+        carry = prefix[k + 3];
+    }
+#endif
+}
+
+template <int width>
+int WideTreeSolver<width>::find_child(const Block &block, double &value) {
+    double prefix[width];
+    prefix_sums(block, prefix);
+
+    // the child is the number of prefix sums which are below value
+    int j = 0;
+#ifdef __AVX2__
+    __m256d v = _mm256_set1_pd(value);
+    for (int k = 0; k < width; k += 4) {
+        __m256d less = _mm256_cmp_pd(
+            _mm256_loadu_pd(prefix + k), v, _CMP_LT_OQ);
+        j += __builtin_popcount(_mm256_movemask_pd(less));
+    }
+#else
+    for (int k = 0; k < width; k++)
+        j += prefix[k] < value;
+#endif
+
+    // value can fall past the end of the block or onto an empty child
+    // because of rounding. In that case, move to the nearest child
+    // with nonzero propensity.
+    if (j == width) j = width - 1;
+    int k = j;
+    while (k >= 0 && block.values[k] == 0.0) k--;
+    if (k < 0) {
+        k = j;
+        while (k < width - 1 && block.values[k] == 0.0) k++;
+    }
+
+    if (k > 0) value -= prefix[k - 1];
+    return k;
+}
+
+template <int width>
+int WideTreeSolver<width>::find_solve_tree(double value) {
+    unsigned long int index = 0;
+    for (unsigned long int l = levels.size(); l-- > 0;)
+        index = index * width + find_child(levels[l][index], value);
+
+    return index;
+}
+
+template <int width>
+void WideTreeSolver<width>::update(Update update) {
+    unsigned long int index = update.index;
+    double &leaf = levels[0][index / width].values[index % width];
+    if (leaf > 0.0) number_of_active_indices--;
+    if (update.propensity > 0.0) number_of_active_indices++;
+    leaf = update.propensity;
+
+    // recompute the block sums on the path to the root
+    double prefix[width];
+    for (unsigned long int l = 0; l + 1 < levels.size(); l++) {
+        index = index / width;
+        prefix_sums(levels[l][index], prefix);
+        levels[l + 1][index / width].values[index % width] = prefix[width - 1];
+    }
+
+    prefix_sums(levels.back()[0], prefix);
+    propensity_sum = prefix[width - 1];
+}
+
+template <int width>
+void WideTreeSolver<width>::update(std::vector<Update> &updates) {
+    // set the changed leaves and record their blocks. Duplicates
+    // carry the same propensity, so skipping unchanged values also
+    // skips them.
+    dirty_blocks.clear();
+    for (Update u : updates) {
+        double &leaf = levels[0][u.index / width].values[u.index % width];
+        if (leaf == u.propensity) continue;
+        if (leaf > 0.0) number_of_active_indices--;
+        if (u.propensity > 0.0) number_of_active_indices++;
+        leaf = u.propensity;
+        dirty_blocks.push_back(u.index / width);
+    }
+
+    if (dirty_blocks.empty()) return;
+
+    // recompute each dirty block sum once, one level at a time.
+    // Dividing a sorted list of blocks by width keeps it sorted, so
+    // shared parents are adjacent.
+    std::sort(dirty_blocks.begin(), dirty_blocks.end());
+    dirty_blocks.erase(
+        std::unique(dirty_blocks.begin(), dirty_blocks.end()),
+        dirty_blocks.end());
+
+    double prefix[width];
+    for (unsigned long int l = 0; l + 1 < levels.size(); l++) {
+        unsigned long int number_of_parents = 0;
+        for (unsigned long int k = 0; k < dirty_blocks.size(); k++) {
+            unsigned long int block = dirty_blocks[k];
+            prefix_sums(levels[l][block], prefix);
+            levels[l + 1][block / width].values[block % width] = prefix[width - 1];
+
+            if (number_of_parents == 0 ||
+                dirty_blocks[number_of_parents - 1] != block / width) {
+                dirty_blocks[number_of_parents] = block / width;
+                number_of_parents++;
+            }
+        }
+        dirty_blocks.resize(number_of_parents);
+    }
+
+    prefix_sums(levels.back()[0], prefix);
+    propensity_sum = prefix[width - 1];
+}
+
+template <int width>
+std::optional<Event> WideTreeSolver<width>::event() {
+    if (number_of_active_indices == 0) {
+        return std::optional<Event>();
+    }
+
+    double r1 = sampler.generate();
+    double r2 = sampler.exponential();
+
+    unsigned long int m = find_solve_tree(r1 * propensity_sum);
+    double dt = r2 / propensity_sum;
+
+    return std::optional<Event>(Event {.index = m, .dt = dt});
+}
+
+template <int width>
+double WideTreeSolver<width>::get_propensity(int index) {
+    return levels[0][index / width].values[index % width];
+}
+
+template <int width>
+double WideTreeSolver<width>::get_propensity_sum() {
+    return propensity_sum;
+}
+
+
+
+// FenwickSolver implementation
+// FenwickSolver copies the initial propensities and builds the tree in place.
+FenwickSolver::FenwickSolver(
+    unsigned long int seed,
+    std::vector<double> &initial_propensities) :
+    sampler (Sampler(seed)),
+    tree (initial_propensities),
+    active (initial_propensities.size(), false),
+    number_of_indices (initial_propensities.size()),
+    number_of_active_indices (0),
+    highest_power_of_two (1),
+    updates_since_rebuild (0) {
+
+        while (highest_power_of_two * 2 <= number_of_indices)
+            highest_power_of_two *= 2;
+
+        for (unsigned long int i = 0; i < number_of_indices; i++) {
+            if (tree[i] > 0.0) {
+                active[i] = true;
+                number_of_active_indices++;
+            }
+        }
+
+        build();
+    };
+
+void FenwickSolver::build() {
+    for (unsigned long int i = 1; i <= number_of_indices; i++) {
+        unsigned long int parent = i + lowbit(i);
+        if (parent <= number_of_indices) tree[parent - 1] += tree[i - 1];
+    }
+}
+
+void FenwickSolver::rebuild() {
+    // undo build. When i is reached, tree[i - 1] still holds its
+    // complete partial sum since only smaller indices contribute to it.
+    for (unsigned long int i = number_of_indices; i >= 1; i--) {
+        unsigned long int parent = i + lowbit(i);
+        if (parent <= number_of_indices) tree[parent - 1] -= tree[i - 1];
+    }
+
+    for (unsigned long int i = 0; i < number_of_indices; i++) {
+        if (! active[i]) tree[i] = 0.0;
+    }
+
+    build();
+    updates_since_rebuild = 0;
+}
+
+double FenwickSolver::prefix_sum(unsigned long int i) {
+    double sum = 0.0;
+    while (i > 0) {
+        sum += tree[i - 1];
+        i -= lowbit(i);
+    }
+    return sum;
+}
+
+int FenwickSolver::find_solve_tree(double value) {
+    // find the smallest index whose inclusive prefix sum is >= value
+    unsigned long int position = 0;
+    for (unsigned long int step = highest_power_of_two; step > 0; step /= 2) {
+        if (position + step <= number_of_indices &&
+            tree[position + step - 1] < value) {
+            position += step;
+            value -= tree[position - 1];
+        }
+    }
+
+    if (position >= number_of_indices) position = number_of_indices - 1;
+
+    // rounding can leave value on an inactive index. Fall back to the
+    // nearest active index.
+    if (! active[position]) {
+        unsigned long int i = position;
+        while (i > 0 && ! active[i]) i--;
+        if (! active[i]) {
+            i = position;
+            while (i < number_of_indices - 1 && ! active[i]) i++;
+        }
+        position = i;
+    }
+
+    return position;
+}
+
+void FenwickSolver::update(Update update) {
+    double old_propensity = get_propensity(update.index);
+
+    if (active[update.index]) number_of_active_indices--;
+    if (update.propensity > 0.0) number_of_active_indices++;
+    active[update.index] = update.propensity > 0.0;
+
+    double delta = update.propensity - old_propensity;
+    for (unsigned long int i = update.index + 1;
+         i <= number_of_indices;
+         i += lowbit(i)) {
+        tree[i - 1] += delta;
+    }
+
+    updates_since_rebuild++;
+    if (updates_since_rebuild >= number_of_indices) rebuild();
+}
+
+// propensities are reconstructed from partial sums, so we can't test
+// for unchanged values exactly. Applying an unchanged value adds a
+// difference of zero (up to rounding).
+void FenwickSolver::update(std::vector<Update> &updates) {
+    for (Update u : updates)
+        update(u);
+}
+
+std::optional<Event> FenwickSolver::event() {
+    if (number_of_active_indices == 0) {
+        return std::optional<Event>();
+    }
+
+    double propensity_sum = get_propensity_sum();
+    double r1 = sampler.generate();
+    double r2 = sampler.exponential();
+
+    unsigned long int m = find_solve_tree(r1 * propensity_sum);
+    double dt = r2 / propensity_sum;
+
+    return std::optional<Event>(Event {.index = m, .dt = dt});
+}
+
+double FenwickSolver::get_propensity(int index) {
+    if (! active[index]) return 0.0;
+
+    // the propensity is the partial sum at index minus the partial
+    // sums of its children in the fenwick tree
+    unsigned long int i = index + 1;
+    unsigned long int stop = i - lowbit(i);
+    double propensity = tree[i - 1];
+    i--;
+    while (i > stop) {
+        propensity -= tree[i - 1];
+        i -= lowbit(i);
+    }
+
+    return propensity;
+}
+
+double FenwickSolver::get_propensity_sum() {
+    return prefix_sum(number_of_indices);
+}
+
+
+
+// AliasSolver implementation
+// AliasSolver copies the initial propensities.
+AliasSolver::AliasSolver(
+    unsigned long int seed,
+    std::vector<double> &initial_propensities) :
+    sampler (Sampler(seed)),
+    propensities (initial_propensities),
+    propensity_sum (0.0),
+    active_indices (),
+    active_position (initial_propensities.size(), -1),
+    table_indices (),
+    table_propensities (initial_propensities.size(), 0.0),
+    alias_probability (),
+    alias (),
+    table_propensity_sum (0.0),
+    excess_indices (),
+    excess_position (initial_propensities.size(), -1),
+    small (),
+    large () {
+
+        for (unsigned long int i = 0; i < propensities.size(); i++) {
+            if (propensities[i] > 0.0)
+                list_insert(active_indices, active_position, i);
+        }
+
+        build_table();
+    };
+
+void AliasSolver::list_insert(
+    std::vector<unsigned long int> &list,
+    std::vector<long int> &position,
+    unsigned long int index) {
+
+    position[index] = list.size();
+    list.push_back(index);
+}
+
+void AliasSolver::list_remove(
+    std::vector<unsigned long int> &list,
+    std::vector<long int> &position,
+    unsigned long int index) {
+
+    unsigned long int last = list.back();
+    list[position[index]] = last;
+    position[last] = position[index];
+    list.pop_back();
+    position[index] = -1;
+}
+
+void AliasSolver::build_table() {
+    // Vose's algorithm over the active indices
+    for (unsigned long int i : table_indices) table_propensities[i] = 0.0;
+    table_indices = active_indices;
+
+    unsigned long int n = table_indices.size();
+    table_propensity_sum = 0.0;
+    for (unsigned long int i : table_indices) {
+        table_propensities[i] = propensities[i];
+        table_propensity_sum += propensities[i];
+    }
+
+    // the table is exact, so we also reset the accumulated rounding
+    // error in propensity_sum
+    propensity_sum = table_propensity_sum;
+
+    for (unsigned long int i : excess_indices) excess_position[i] = -1;
+    excess_indices.clear();
+
+    alias_probability.resize(n);
+    alias.resize(n);
+    small.clear();
+    large.clear();
+    for (unsigned long int k = 0; k < n; k++) {
+        alias_probability[k] =
+            table_propensities[table_indices[k]] * n / table_propensity_sum;
+        alias[k] = k;
+        if (alias_probability[k] < 1.0) small.push_back(k);
+        else large.push_back(k);
+    }
+
+    while (! small.empty() && ! large.empty()) {
+        unsigned long int s = small.back();
+        unsigned long int l = large.back();
+        small.pop_back();
+        alias[s] = l;
+        alias_probability[l] -= 1.0 - alias_probability[s];
+        if (alias_probability[l] < 1.0) {
+            large.pop_back();
+            small.push_back(l);
+        }
+    }
+
+    // whatever remains is 1 up to rounding
+    for (unsigned long int k : small) alias_probability[k] = 1.0;
+    for (unsigned long int k : large) alias_probability[k] = 1.0;
+}
+
+double AliasSolver::excess(unsigned long int index) {
+    return propensities[index] - table_propensities[index];
+}
+
+void AliasSolver::update(Update update) {
+    unsigned long int i = update.index;
+    propensity_sum += update.propensity - propensities[i];
+    propensities[i] = update.propensity;
+
+    bool is_active = propensities[i] > 0.0;
+    if (is_active && active_position[i] < 0)
+        list_insert(active_indices, active_position, i);
+    else if (! is_active && active_position[i] >= 0)
+        list_remove(active_indices, active_position, i);
+
+    bool has_excess = propensities[i] > table_propensities[i];
+    if (has_excess && excess_position[i] < 0)
+        list_insert(excess_indices, excess_position, i);
+    else if (! has_excess && excess_position[i] >= 0)
+        list_remove(excess_indices, excess_position, i);
+}
+
+void AliasSolver::update(std::vector<Update> &updates) {
+    for (Update u : updates)
+        if (get_propensity(u.index) != u.propensity) update(u);
+}
+
+std::optional<Event> AliasSolver::event() {
+    if (active_indices.empty()) {
+        propensity_sum = 0.0;
+        return std::optional<Event>();
+    }
+
+    double excess_sum = 0.0;
+    for (unsigned long int i : excess_indices) excess_sum += excess(i);
+
+    unsigned long int max_excess_indices = std::max(
+        min_excess_indices,
+        (unsigned long int) std::sqrt(table_indices.size()));
+
+    if (excess_indices.size() > max_excess_indices ||
+        table_propensity_sum + excess_sum > rebuild_factor * propensity_sum) {
+        build_table();
+        excess_sum = 0.0;
+    }
+
+    double r1 = sampler.generate();
+    double r2 = sampler.exponential();
+    double n = table_indices.size();
+    double fraction = (table_propensity_sum + excess_sum) * r1;
+    unsigned long int m;
+
+    while (true) {
+        if (fraction < table_propensity_sum) {
+            // sample from the table. The integer part of r * n picks
+            // the slot and the fractional part chooses between the
+            // slot and its alias.
+            double r = sampler.generate() * n;
+            unsigned long int slot = r;
+            if (slot >= table_indices.size()) slot = table_indices.size() - 1;
+            if ((r - slot) >= alias_probability[slot]) slot = alias[slot];
+            m = table_indices[slot];
+
+            if (propensities[m] >= table_propensities[m] ||
+                sampler.generate() * table_propensities[m] < propensities[m])
+                break;
+
+        } else {
+            // sample from the side list
+            double partial = table_propensity_sum;
+            unsigned long int k;
+            for (k = 0; k < excess_indices.size() - 1; k++) {
+                partial += excess(excess_indices[k]);
+                if (partial > fraction) break;
+            }
+            m = excess_indices[k];
+            break;
+        }
+
+        // rejected
+        fraction = (table_propensity_sum + excess_sum) * sampler.generate();
+    }
+
+    double dt = r2 / propensity_sum;
+    return std::optional<Event>(Event {.index = m, .dt = dt});
+}
+
+double AliasSolver::get_propensity(int index) {
+    return propensities[index];
+}
+
+double AliasSolver::get_propensity_sum() {
+    return propensity_sum;
+}
+
+
+
+// SortingLinearSolver implementation
+// SortingLinearSolver copies the nonzero initial propensities.
+SortingLinearSolver::SortingLinearSolver(
+    unsigned long int seed,
+    std::vector<double> &initial_propensities) :
+    sampler (Sampler(seed)),
+    propensities (),
+    indices (),
+    position (initial_propensities.size(), -1),
+    propensity_sum (0.0) {
+
+        for (unsigned long int i = 0; i < initial_propensities.size(); i++) {
+            if (initial_propensities[i] > 0.0) {
+                position[i] = propensities.size();
+                propensities.push_back(initial_propensities[i]);
+                indices.push_back(i);
+                propensity_sum += initial_propensities[i];
+            }
+        }
+    };
+
+void SortingLinearSolver::update(Update update) {
+    long int k = position[update.index];
+
+    if (k >= 0) {
+        propensity_sum -= propensities[k];
+
+        if (update.propensity > 0.0) {
+            propensities[k] = update.propensity;
+        } else {
+            // move the last entry into the vacated position
+            propensities[k] = propensities.back();
+            indices[k] = indices.back();
+            position[indices[k]] = k;
+            propensities.pop_back();
+            indices.pop_back();
+            position[update.index] = -1;
+        }
+
+    } else if (update.propensity > 0.0) {
+        position[update.index] = propensities.size();
+        propensities.push_back(update.propensity);
+        indices.push_back(update.index);
+    }
+
+    propensity_sum += update.propensity;
+}
+
+void SortingLinearSolver::update(std::vector<Update> &updates) {
+    for (Update u : updates)
+        if (get_propensity(u.index) != u.propensity) update(u);
+}
+
+std::optional<Event> SortingLinearSolver::event() {
+    if (propensities.empty()) {
+        propensity_sum = 0.0;
+        return std::optional<Event>();
+    }
+
+    double r1 = sampler.generate();
+    double r2 = sampler.exponential();
+    double fraction = propensity_sum * r1;
+    double partial = 0.0;
+
+    unsigned long int k;
+    for (k = 0; k < propensities.size() - 1; k++) {
+        partial += propensities[k];
+        if (partial > fraction) break;
+    }
+
+    unsigned long int m = indices[k];
+
+    // move the index which fired one place towards the front
+    if (k > 0) {
+        std::swap(propensities[k], propensities[k - 1]);
+        std::swap(indices[k], indices[k - 1]);
+        position[indices[k]] = k;
+        position[indices[k - 1]] = k - 1;
+    }
+
+    double dt = r2 / propensity_sum;
+    return std::optional<Event>(Event {.index = m, .dt = dt});
+}
+
+double SortingLinearSolver::get_propensity(int index) {
+    long int k = position[index];
+    if (k < 0) return 0.0;
+    else return propensities[k];
+}
+
+double SortingLinearSolver::get_propensity_sum() {
+    return propensity_sum;
+}
+
+
+
+// EqualRateSolver implementation
+// EqualRateSolver only stores the class of each index.
+EqualRateSolver::EqualRateSolver(
+    unsigned long int seed,
+    std::vector<double> &initial_propensities) :
+    sampler (Sampler(seed)),
+    classes (),
+    number_of_classes (0),
+    class_of_propensity (),
+    class_index (initial_propensities.size(), -1),
+    member_position (initial_propensities.size(), 0),
+    number_of_active_indices (0),
+    propensity_sum (0.0) {
+
+        for (unsigned long int i = 0; i < initial_propensities.size(); i++) {
+            update(Update {.index = i, .propensity = initial_propensities[i]});
+        }
+    };
+
+int EqualRateSolver::find_class(double propensity) {
+    auto it = class_of_propensity.find(propensity);
+    if (it != class_of_propensity.end()) return it->second;
+
+    int c = number_of_classes;
+    if (number_of_classes == classes.size())
+        classes.push_back(RateClass {
+                .propensity = propensity,
+                .members = std::vector<unsigned long int> ()});
+    else
+        classes[c].propensity = propensity;
+
+    number_of_classes++;
+    class_of_propensity[propensity] = c;
+    return c;
+}
+
+// swap the empty class c with the last class in use
+void EqualRateSolver::remove_class(int c) {
+    class_of_propensity.erase(classes[c].propensity);
+
+    int last = number_of_classes - 1;
+    if (c != last) {
+        std::swap(classes[c], classes[last]);
+        class_of_propensity[classes[c].propensity] = c;
+        for (unsigned long int m : classes[c].members)
+            class_index[m] = c;
+    }
+
+    number_of_classes--;
+}
+
+void EqualRateSolver::update(Update update) {
+    unsigned long int i = update.index;
+    int old_class = class_index[i];
+
+    if (old_class >= 0 && classes[old_class].propensity == update.propensity)
+        return;
+
+    if (old_class >= 0) {
+        // move the last member into the vacated position
+        std::vector<unsigned long int> &members = classes[old_class].members;
+        unsigned long int last = members.back();
+        members[member_position[i]] = last;
+        member_position[last] = member_position[i];
+        members.pop_back();
+        class_index[i] = -1;
+        number_of_active_indices--;
+        propensity_sum -= classes[old_class].propensity;
+
+        if (members.empty()) remove_class(old_class);
+    }
+
+    if (update.propensity > 0.0) {
+        int c = find_class(update.propensity);
+        class_index[i] = c;
+        member_position[i] = classes[c].members.size();
+        classes[c].members.push_back(i);
+        number_of_active_indices++;
+        propensity_sum += update.propensity;
+    }
+}
+
+void EqualRateSolver::update(std::vector<Update> &updates) {
+    for (Update u : updates)
+        if (get_propensity(u.index) != u.propensity) update(u);
+}
+
+std::optional<Event> EqualRateSolver::event() {
+    if (number_of_active_indices == 0) {
+        propensity_sum = 0.0;
+        return std::optional<Event>();
+    }
+
+    double r1 = sampler.generate();
+    double r2 = sampler.exponential();
+    double fraction = propensity_sum * r1;
+    double partial = 0.0;
+
+    // choose a class by weight count * propensity
+    unsigned long int c;
+    for (c = 0; c < number_of_classes - 1; c++) {
+        double weight = classes[c].members.size() * classes[c].propensity;
+        if (partial + weight > fraction) break;
+        partial += weight;
+    }
+
+    // the position of fraction inside the class is uniform, so it
+    // also picks the member.
+    std::vector<unsigned long int> &members = classes[c].members;
+    unsigned long int position = (fraction - partial) / classes[c].propensity;
+    if (position >= members.size()) position = members.size() - 1;
+
+    unsigned long int m = members[position];
+    double dt = r2 / propensity_sum;
+    return std::optional<Event>(Event {.index = m, .dt = dt});
+}
+
+double EqualRateSolver::get_propensity(int index) {
+    int c = class_index[index];
+    if (c < 0) return 0.0;
+    else return classes[c].propensity;
+}
+
+double EqualRateSolver::get_propensity_sum() {
+    return propensity_sum;
+}
+
+
+
+// MixedPrecisionTreeSolver implementation
+// MixedPrecisionTreeSolver copies the initial propensities, rounded to
+// floats.
+MixedPrecisionTreeSolver::MixedPrecisionTreeSolver(
+    unsigned long int seed,
+    std::vector<double> &initial_propensities) :
+    sampler (Sampler(seed)),
+    tree (initial_propensities.size()),
+    number_of_indices (initial_propensities.size()),
+    number_of_active_indices (0) {
+
+        for (int i = 0; i < number_of_indices; i++) {
+            tree.leaves[i] = to_leaf(initial_propensities[i]);
+            if (tree.leaves[i] > 0.0f) number_of_active_indices++;
+        }
+
+        tree.build();
+    };
+
+float MixedPrecisionTreeSolver::to_leaf(double propensity) {
+    float leaf = propensity;
+    if (leaf == 0.0f && propensity > 0.0)
+        leaf = std::numeric_limits<float>::denorm_min();
+
+    return leaf;
+}
+
+void MixedPrecisionTreeSolver::count_leaf(unsigned long int index, float leaf) {
+    if (tree.leaves[index] > 0.0f) number_of_active_indices--;
+    if (leaf > 0.0f) number_of_active_indices++;
+}
+
+void MixedPrecisionTreeSolver::update(Update update) {
+    float leaf = to_leaf(update.propensity);
+    count_leaf(update.index, leaf);
+    tree.set(update.index, leaf);
+}
+
+void MixedPrecisionTreeSolver::update(std::vector<Update> &updates) {
+    // unchanged values are compared after rounding to a float
+    for (Update u : updates) {
+        float leaf = to_leaf(u.propensity);
+        if (tree.leaves[u.index] == leaf) continue;
+        count_leaf(u.index, leaf);
+        tree.stage(u.index, leaf);
+    }
+
+    tree.propagate();
+}
+
+std::optional<Event> MixedPrecisionTreeSolver::event() {
+    if (number_of_active_indices == 0) {
+        return std::optional<Event>();
+    }
+
+    double r1 = sampler.generate();
+    double r2 = sampler.exponential();
+
+    unsigned long int m = tree.find(r1 * tree.sum());
+    double dt = r2 / tree.sum();
+
+    return std::optional<Event>(Event {.index = m, .dt = dt});
+}
+
+double MixedPrecisionTreeSolver::get_propensity(int index) {
+    return tree.leaves[index];
+}
+
+double MixedPrecisionTreeSolver::get_propensity_sum() {
+    return tree.sum();
+}
+
+
+
+// CheckedMixedPrecisionTreeSolver implementation
+CheckedMixedPrecisionTreeSolver::CheckedMixedPrecisionTreeSolver(
+    unsigned long int seed,
+    std::vector<double> &initial_propensities) :
+    solver (seed, initial_propensities),
+    reference_solver (seed, initial_propensities),
+    number_of_events (0),
+    number_of_disagreements (0) {};
+
+void CheckedMixedPrecisionTreeSolver::update(Update update) {
+    solver.update(update);
+    reference_solver.update(update);
+}
+
+void CheckedMixedPrecisionTreeSolver::update(std::vector<Update> &updates) {
+    solver.update(updates);
+    reference_solver.update(updates);
+}
+
+std::optional<Event> CheckedMixedPrecisionTreeSolver::event() {
+    std::optional<Event> event = solver.event();
+    std::optional<Event> reference_event = reference_solver.event();
+    number_of_events++;
+
+    bool disagree = event.has_value() != reference_event.has_value() ||
+        (event && event.value().index != reference_event.value().index);
+
+    if (disagree) {
+        number_of_disagreements++;
+
+        // written in one piece, so lines from different threads don't
+        // interleave
+        std::ostringstream message;
+        message << "mixed precision tree: event " << number_of_events
+                << " selected ";
+        if (event) message << "index " << event.value().index;
+        else message << "no index";
+        message << ", double tree selected ";
+        if (reference_event) message << "index " << reference_event.value().index;
+        else message << "no index";
+        message << " (propensity sums " << solver.get_propensity_sum()
+                << " and " << reference_solver.get_propensity_sum()
+                << ", " << number_of_disagreements << " of "
+                << number_of_events << " events disagree)\n";
+        std::cerr << message.str();
+    }
+
+    return event;
+}
+
+double CheckedMixedPrecisionTreeSolver::get_propensity(int index) {
+    return solver.get_propensity(index);
+}
+
+double CheckedMixedPrecisionTreeSolver::get_propensity_sum() {
+    return solver.get_propensity_sum();
+}
+
+
+
+// UniformizationSolver implementation
+// UniformizationSolver copies the initial propensities.
+UniformizationSolver::UniformizationSolver(
+    unsigned long int seed,
+    std::vector<double> &initial_propensities) :
+    sampler (Sampler(seed)),
+    tree (initial_propensities.size()),
+    number_of_indices (initial_propensities.size()),
+    number_of_active_indices (0),
+    bound (0.0),
+    model_bound (std::numeric_limits<double>::infinity()),
+    time (0.0),
+    window_end (0.0),
+    candidate_times (window_size),
+    acceptances (window_size),
+    next_candidate (window_size) {
+
+        for (int i = 0; i < number_of_indices; i++) {
+            tree.leaves[i] = initial_propensities[i];
+            if (initial_propensities[i] > 0.0) number_of_active_indices++;
+        }
+
+        tree.build();
+    };
+
+void UniformizationSolver::update(Update update) {
+    if (tree.leaves[update.index] > 0.0) number_of_active_indices--;
+    if (update.propensity > 0.0) number_of_active_indices++;
+    tree.set(update.index, update.propensity);
+}
+
+void UniformizationSolver::update(std::vector<Update> &updates) {
+    for (Update u : updates) {
+        if (tree.leaves[u.index] == u.propensity) continue;
+        if (tree.leaves[u.index] > 0.0) number_of_active_indices--;
+        if (u.propensity > 0.0) number_of_active_indices++;
+        tree.stage(u.index, u.propensity);
+    }
+
+    tree.propagate();
+}
+
+void UniformizationSolver::generate_window() {
+    for (unsigned long int k = 0; k < window_size; k++)
+        candidate_times[k] = sampler.exponential();
+
+    for (unsigned long int k = 0; k < window_size; k++)
+        acceptances[k] = sampler.generate() * bound;
+
+    double scale = 1.0 / bound;
+    double candidate_time = window_end;
+    for (unsigned long int k = 0; k < window_size; k++) {
+        candidate_time += candidate_times[k] * scale;
+        candidate_times[k] = candidate_time;
+    }
+
+    next_candidate = 0;
+    window_end = candidate_time;
+}
+
+std::optional<Event> UniformizationSolver::event() {
+    if (number_of_active_indices == 0) {
+        return std::optional<Event>();
+    }
+
+    double propensity_sum = tree.sum();
+    if (propensity_sum > bound || propensity_sum < bound / 4.0) {
+        // rounding can put the sum slightly above the model bound
+        double new_bound = std::max(
+            propensity_sum,
+            std::min(model_bound, bound_headroom * propensity_sum));
+
+        if (new_bound != bound) {
+            bound = new_bound;
+            next_candidate = window_size;
+            window_end = time;
+        }
+    }
+
+    while (true) {
+        if (next_candidate == window_size) generate_window();
+
+        double candidate_time = candidate_times[next_candidate];
+        double acceptance = acceptances[next_candidate];
+        next_candidate++;
+
+        if (acceptance < propensity_sum) {
+            unsigned long int m = tree.find(acceptance);
+            double dt = candidate_time - time;
+            time = candidate_time;
+            return std::optional<Event>(Event {.index = m, .dt = dt});
+        }
+    }
+}
+
+double UniformizationSolver::get_propensity(int index) {
+    return tree.leaves[index];
+}
+
+double UniformizationSolver::get_propensity_sum() {
+    return tree.sum();
+}
+
+void UniformizationSolver::set_propensity_bound(double propensity_bound) {
+    model_bound = propensity_bound;
 }
@@ -0,0 +1,409 @@
+#pragma once
+#include <vector>
+#include <string>
+#include <optional>
+#include <iostream>
+#include <cstdlib>
+#include <cctype>
+#include <cmath>
+#include <algorithm>
+
+// conditions for stopping a trajectory before step_cutoff. They are
+// written as
+//
+//     time >= t         simulated time has reached t
+//     state[i] >= n     state entry i is at least n. In GMC, state
+//     state[i] <= n     entry i is the count of species i, and in NPMC
+//                       it is the degree of freedom of site i.
+//     count[v] >= n     at least n state entries are equal to v, for
+//     count[v] <= n     example n sites of a nano particle are in state v
+//     fraction[v] >= f  like count, as a fraction of all state entries
+//     fraction[v] <= f
+//
+// combined with and, or and parentheses, where and binds tighter than
+// or. For example
+//
+//     state[12] >= 1 or time >= 100
+//
+// The condition is checked after every step. Checking costs time
+// proportional to the size of the condition, since the number of state
+// entries equal to each value which appears in a count or fraction is
+// kept up to date from the entries changed by a step. A trajectory
+// stops at the first step after which the condition holds. The time
+// of that step and the alternative which held (the index of the first
+// true operand of the top level or, or 0 if there is none) are its
+// first passage.
+//
+// The state doesn't change between steps, but time does, so a time
+// condition can start to hold before the next step happens. Before a
+// step is taken, the condition is also checked at every time threshold
+// up to the time of the step. If it holds at one of them, the
+// trajectory stops there and the step is never taken, so the first
+// passage time is the threshold.
+
+enum class ConditionKind {
+    time,
+    state,
+    count,
+    all, // and
+    any  // or
+};
+
+struct ConditionNode {
+    ConditionKind kind;
+    bool at_least; // >= if true and <= otherwise
+    int index; // state entry for state, value for count
+    double threshold;
+    bool fraction; // threshold of a count is a fraction
+    std::vector<int> children; // nodes combined by all and any
+};
+
+struct StoppingCondition {
+    std::vector<ConditionNode> nodes;
+    int root;
+
+    // operands of the top level or
+    std::vector<int> alternatives;
+
+    // values which appear in a count, the number of entries of the
+    // initial state equal to each, and the tracked value of each count
+    // node
+    std::vector<int> tracked_values;
+    std::vector<int> initial_value_counts;
+
+    // thresholds of the time nodes in increasing order
+    std::vector<double> horizons;
+
+    StoppingCondition() : root (-1) {};
+
+    bool empty() { return root < 0; };
+
+    // returns an empty optional and prints the problem if condition
+    // doesn't parse
+    static std::optional<StoppingCondition> parse(std::string condition);
+
+    // resolve fractions and count the values in the initial state.
+    // Returns false if the condition refers to a state entry which
+    // doesn't exist.
+    bool compile(std::vector<int> &initial_state);
+
+    // index into tracked_values of value, or -1
+    int tracked_value(int value);
+};
+
+
+// recursive descent parser for the grammar above
+struct ConditionParser {
+    std::string text;
+    unsigned long int position;
+    std::vector<ConditionNode> &nodes;
+    bool failed;
+
+    ConditionParser(std::string text, std::vector<ConditionNode> &nodes) :
+        text (text),
+        position (0),
+        nodes (nodes),
+        failed (false) {};
+
+    void skip_space() {
+        while (position < text.size() && std::isspace(text[position]))
+            position++;
+    };
+
+    bool accept(std::string token) {
+        skip_space();
+        if (text.compare(position, token.size(), token) != 0) return false;
+
+        // keywords need to end at a word boundary
+        unsigned long int end = position + token.size();
+        if (std::isalpha(token.back()) && end < text.size() &&
+            (std::isalnum(text[end]) || text[end] == '_'))
+            return false;
+
+        position = end;
+        return true;
+    };
+
+    void fail(std::string expected) {
+        if (! failed)
+            std::cerr << "stopping condition: expected " << expected
+                      << " at position " << position
+                      << " of \"" << text << "\"\n";
+        failed = true;
+    };
+
+    double number() {
+        skip_space();
+        const char *start = text.c_str() + position;
+        char *end;
+        double value = std::strtod(start, &end);
+        if (end == start) {
+            fail("a number");
+            return 0.0;
+        }
+        position += end - start;
+        return value;
+    };
+
+    int add(ConditionNode node) {
+        nodes.push_back(node);
+        return nodes.size() - 1;
+    };
+
+    int combine(ConditionKind kind, std::vector<int> &operands) {
+        if (operands.size() == 1) return operands[0];
+        return add(ConditionNode {
+                .kind = kind,
+                .at_least = false,
+                .index = 0,
+                .threshold = 0.0,
+                .fraction = false,
+                .children = operands});
+    };
+
+    int disjunction() {
+        std::vector<int> operands = {conjunction()};
+        while (! failed && accept("or")) operands.push_back(conjunction());
+        return combine(ConditionKind::any, operands);
+    };
+
+    int conjunction() {
+        std::vector<int> operands = {atom()};
+        while (! failed && accept("and")) operands.push_back(atom());
+        return combine(ConditionKind::all, operands);
+    };
+
+    bool comparison() {
+        if (accept(">=")) return true;
+        if (accept("<=")) return false;
+        fail(">= or <=");
+        return false;
+    };
+
+    int subscript() {
+        if (! accept("[")) fail("[");
+        double value = number();
+        if (! accept("]")) fail("]");
+        if (value != std::floor(value)) fail("an integer subscript");
+        return value;
+    };
+
+    int atom() {
+        if (failed) return -1;
+
+        if (accept("(")) {
+            int node = disjunction();
+            if (! accept(")")) fail(")");
+            return node;
+        }
+
+        ConditionNode node {
+            .kind = ConditionKind::time,
+            .at_least = true,
+            .index = 0,
+            .threshold = 0.0,
+            .fraction = false,
+            .children = {}};
+
+        if (accept("time")) {
+            if (! accept(">=")) fail(">=");
+        } else if (accept("state")) {
+            node.kind = ConditionKind::state;
+            node.index = subscript();
+            node.at_least = comparison();
+        } else if (accept("count")) {
+            node.kind = ConditionKind::count;
+            node.index = subscript();
+            node.at_least = comparison();
+        } else if (accept("fraction")) {
+            node.kind = ConditionKind::count;
+            node.fraction = true;
+            node.index = subscript();
+            node.at_least = comparison();
+        } else {
+            fail("time, state, count, fraction or (");
+            return -1;
+        }
+
+        node.threshold = number();
+        return add(node);
+    };
+};
+
+
+std::optional<StoppingCondition> StoppingCondition::parse(std::string condition) {
+    StoppingCondition result;
+    ConditionParser parser (condition, result.nodes);
+    result.root = parser.disjunction();
+    parser.skip_space();
+    if (! parser.failed && parser.position != condition.size())
+        parser.fail("and, or or the end");
+
+    if (parser.failed) return std::optional<StoppingCondition> ();
+
+    ConditionNode &root = result.nodes[result.root];
+    if (root.kind == ConditionKind::any)
+        result.alternatives = root.children;
+    else
+        result.alternatives = {result.root};
+
+    return std::optional<StoppingCondition> (std::move(result));
+};
+
+int StoppingCondition::tracked_value(int value) {
+    for (unsigned long int k = 0; k < tracked_values.size(); k++)
+        if (tracked_values[k] == value) return k;
+
+    return -1;
+};
+
+bool StoppingCondition::compile(std::vector<int> &initial_state) {
+    for (ConditionNode &node : nodes) {
+        if (node.kind == ConditionKind::time)
+            horizons.push_back(node.threshold);
+
+        if (node.kind == ConditionKind::state &&
+            (node.index < 0 || node.index >= (int) initial_state.size())) {
+            std::cerr << "stopping condition: there is no state entry "
+                      << node.index << '\n';
+            return false;
+        }
+
+        if (node.kind != ConditionKind::count) continue;
+
+        if (node.fraction) {
+            node.threshold *= initial_state.size();
+            node.fraction = false;
+        }
+
+        if (tracked_value(node.index) < 0) {
+            tracked_values.push_back(node.index);
+            initial_value_counts.push_back(0);
+        }
+    }
+
+    for (int value : initial_state) {
+        int k = tracked_value(value);
+        if (k >= 0) initial_value_counts[k]++;
+    }
+
+    std::sort(horizons.begin(), horizons.end());
+    return true;
+};
+
+
+// the part of a stopping condition which belongs to a single
+// trajectory. Simulations call start at the beginning of each
+// trajectory, check_horizons before each step with the time of the
+// step, and check after it with the state entries the step changed
+// and their values before it.
+struct StoppingMonitor {
+    StoppingCondition *condition;
+    std::vector<int> value_counts;
+
+    bool stopped;
+    double first_passage_time;
+    int alternative;
+
+    StoppingMonitor() :
+        condition (nullptr),
+        stopped (false),
+        first_passage_time (0.0),
+        alternative (-1) {};
+
+    void start(StoppingCondition *new_condition) {
+        condition = new_condition;
+        stopped = false;
+        first_passage_time = 0.0;
+        alternative = -1;
+        if (condition) value_counts = condition->initial_value_counts;
+    };
+
+    bool active() { return condition != nullptr; };
+
+    void record_change(int old_value, int new_value) {
+        if (old_value == new_value) return;
+        for (unsigned long int k = 0; k < condition->tracked_values.size(); k++) {
+            if (condition->tracked_values[k] == old_value) value_counts[k]--;
+            if (condition->tracked_values[k] == new_value) value_counts[k]++;
+        }
+    };
+
+    bool evaluate(int node_index, double time, std::vector<int> &state);
+
+    // returns true once the condition holds, and records the first
+    // passage the first time it does
+    bool check(double time, std::vector<int> &state);
+
+    // check the condition at the time thresholds in (time, next_time]
+    // with the current state. Returns true if it holds at one of them,
+    // in which case the step to next_time must not be taken.
+    bool check_horizons(double time, double next_time, std::vector<int> &state);
+};
+
+
+bool StoppingMonitor::evaluate(int node_index, double time, std::vector<int> &state) {
+    ConditionNode &node = condition->nodes[node_index];
+    double value;
+
+    switch (node.kind) {
+    case ConditionKind::all:
+        for (int child : node.children)
+            if (! evaluate(child, time, state)) return false;
+        return true;
+
+    case ConditionKind::any:
+        for (int child : node.children)
+            if (evaluate(child, time, state)) return true;
+        return false;
+
+    case ConditionKind::time:
+        return time >= node.threshold;
+
+    case ConditionKind::state:
+        value = state[node.index];
+        break;
+
+    case ConditionKind::count:
+        value = value_counts[condition->tracked_value(node.index)];
+        break;
+
+    default:
+        return false;
+    }
+
+    return node.at_least ? value >= node.threshold : value <= node.threshold;
+};
+
+bool StoppingMonitor::check(double time, std::vector<int> &state) {
+    if (! condition) return false;
+    if (stopped) return true;
+
+    for (unsigned long int k = 0; k < condition->alternatives.size(); k++) {
+        if (evaluate(condition->alternatives[k], time, state)) {
+            stopped = true;
+            first_passage_time = time;
+            alternative = k;
+            return true;
+        }
+    }
+
+    return false;
+};
+
+bool StoppingMonitor::check_horizons(
+    double time,
+    double next_time,
+    std::vector<int> &state) {
+
+    if (! condition) return false;
+    if (stopped) return true;
+
+    for (double horizon : condition->horizons) {
+        if (horizon <= time) continue;
+        if (horizon > next_time) break;
+        if (check(horizon, state)) return true;
+    }
+
+    return false;
+};
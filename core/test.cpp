@@ -1,8 +1,438 @@
 #include "solvers.h"
+#include "queues.h"
+#include "stopping_condition.h"
+#include "simulation.h"
 #include <iostream>
 #include <functional>
 
 
+// sample a solver after some single and batched updates and check that the empirical
+// distribution of events is close to the propensities.
+template <typename Solver>
+bool check_distribution(std::string solver_name) {
+    std::vector<double> initial_propensities = {
+        0.1, 0.0, 0.3, 1e-3, 2.0, 0.0, 0.7, 5.0, 0.25, 0.0};
+
+    Solver solver (42, std::ref(initial_propensities));
+    solver.update(Update {.index = 1, .propensity = 0.4});
+    solver.update(Update {.index = 7, .propensity = 0.0});
+    solver.update(Update {.index = 4, .propensity = 1.5});
+    solver.update(Update {.index = 5, .propensity = 3.0});
+
+    // a batch with a duplicate and an unchanged value
+    std::vector<Update> updates = {
+        Update {.index = 5, .propensity = 0.9},
+        Update {.index = 8, .propensity = 0.25},
+        Update {.index = 0, .propensity = 0.0},
+        Update {.index = 5, .propensity = 0.9},
+        Update {.index = 3, .propensity = 0.2}};
+    solver.update(updates);
+
+    std::vector<double> propensities (initial_propensities.size());
+    double propensity_sum = 0.0;
+    for (unsigned long int i = 0; i < propensities.size(); i++) {
+        propensities[i] = solver.get_propensity(i);
+        propensity_sum += propensities[i];
+    }
+
+    constexpr int number_of_events = 1000000;
+    std::vector<int> counts (propensities.size(), 0);
+    for (int i = 0; i < number_of_events; i++)
+        counts[solver.event().value().index]++;
+
+    for (unsigned long int i = 0; i < propensities.size(); i++) {
+        double p = propensities[i] / propensity_sum;
+        double expected = p * number_of_events;
+        double sigma = std::sqrt(number_of_events * p * (1 - p));
+        if ((p == 0.0 && counts[i] != 0) ||
+            std::abs(counts[i] - expected) > 5 * sigma + 1) {
+
+            std::cout << solver_name << ": index " << i
+                      << " fired " << counts[i]
+                      << " times, expected " << expected << '\n';
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+// the waiting times of uniformization come from the candidates which
+// are rejected as well, so with a model bound which is tighter than
+// the default headroom, they still have to have mean 1 / propensity_sum.
+bool check_uniformization_bound() {
+    std::vector<double> propensities = {0.1, 0.0, 0.3, 2.0, 0.6};
+    double propensity_sum = 3.0;
+
+    UniformizationSolver solver (42, std::ref(propensities));
+    solver.set_propensity_bound(1.25 * propensity_sum);
+
+    constexpr int number_of_events = 1000000;
+    double time = 0.0;
+    for (int i = 0; i < number_of_events; i++)
+        time += solver.event().value().dt;
+
+    double mean = time / number_of_events;
+    double sigma = 1.0 / (propensity_sum * std::sqrt(number_of_events));
+    if (std::abs(mean - 1.0 / propensity_sum) > 5 * sigma) {
+        std::cout << "UniformizationSolver: mean waiting time " << mean
+                  << " with a model bound, expected "
+                  << 1.0 / propensity_sum << '\n';
+        return false;
+    }
+
+    return true;
+}
+
+
+// validation for solvers which approximate the propensities of a
+// reference solver. Both solvers are driven with the same seed through
+// the same updates on propensities spanning 12 orders of magnitude,
+// so they draw the same random numbers and select the same event
+// unless rounding moves a boundary. The fraction of mismatched events
+// bounds the total variation distance between the event distributions
+// of the two solvers, which is how we check that there is no
+// measurable bias.
+template <typename Solver, typename ReferenceSolver>
+bool check_against_reference(std::string solver_name) {
+    constexpr int number_of_indices = 10000;
+    constexpr int number_of_events = 1000000;
+    constexpr double max_mismatch_fraction = 1e-4;
+
+    Sampler sampler (7);
+    auto random_propensity = [&] () {
+        double u = sampler.generate();
+        if (u < 0.1) return 0.0;
+        return std::pow(10.0, 12.0 * sampler.generate() - 6.0);
+    };
+
+    std::vector<double> initial_propensities (number_of_indices);
+    for (double &propensity : initial_propensities)
+        propensity = random_propensity();
+
+    Solver solver (42, std::ref(initial_propensities));
+    ReferenceSolver reference_solver (42, std::ref(initial_propensities));
+
+    int mismatches = 0;
+    std::vector<Update> updates;
+    for (int i = 0; i < number_of_events; i++) {
+        Event event = solver.event().value();
+        Event reference_event = reference_solver.event().value();
+        if (event.index != reference_event.index) mismatches++;
+
+        // change a few propensities, as a step would
+        updates.clear();
+        for (int k = 0; k < 4; k++) {
+            unsigned long int index = sampler.generate() * number_of_indices;
+            updates.push_back(Update {
+                    .index = index,
+                    .propensity = random_propensity()});
+        }
+        solver.update(updates);
+        reference_solver.update(updates);
+    }
+
+    if (mismatches > max_mismatch_fraction * number_of_events) {
+        std::cout << solver_name << ": " << mismatches
+                  << " of " << number_of_events
+                  << " events differ from the reference solver\n";
+        return false;
+    }
+
+    return true;
+}
+
+
+// PhiloxSampler against the known answers of the reference
+// implementation, and checks that skipping and copying agree with
+// drawing in sequence and that the variates have the right moments.
+bool check_philox_sampler() {
+    uint64_t outputs[PhiloxEngine::outputs_per_fill];
+    PhiloxEngine zero (0, 0);
+    zero.fill(0, outputs);
+    if (outputs[0] != 0x6627e8d5e169c58d || outputs[1] != 0xbc57ac4c9b00dbd8) {
+        std::cout << "PhiloxSampler: wrong output for zero key and counter\n";
+        return false;
+    }
+
+    PhiloxEngine pi (0x299f31d0a4093822, 0x0370734413198a2e);
+    uint64_t pi_block = 0x85a308d3243f6a88;
+    int lane = pi_block % PhiloxEngine::lanes;
+    pi.fill(pi_block / PhiloxEngine::lanes, outputs);
+    if (outputs[2 * lane] != 0xd16cfe0994fdcceb ||
+        outputs[2 * lane + 1] != 0x5001e42024126ea1) {
+        std::cout << "PhiloxSampler: wrong output for the digits of pi\n";
+        return false;
+    }
+
+    PhiloxSampler sequential (42, 3);
+    PhiloxSampler skipped (42, 3);
+    for (int i = 0; i < 1001; i++) sequential.generate();
+    skipped.skip(100);
+    skipped.skip(901);
+    PhiloxSampler copy = sequential;
+    for (int i = 0; i < 10; i++) {
+        double u = sequential.generate();
+        if (u != skipped.generate() || u != copy.generate()) {
+            std::cout << "PhiloxSampler: skip or copy out of step\n";
+            return false;
+        }
+    }
+
+    PhiloxSampler other_stream (42, 4);
+    if (other_stream.generate() == PhiloxSampler(42, 3).generate()) {
+        std::cout << "PhiloxSampler: streams are not independent\n";
+        return false;
+    }
+
+    // sample moments, checked to 5 standard errors
+    constexpr int number_of_samples = 1000000;
+    auto check_moments = [&] (std::string name, double mean, double variance,
+                              auto draw) {
+        double sum = 0.0;
+        double square_sum = 0.0;
+        for (int i = 0; i < number_of_samples; i++) {
+            double x = draw();
+            sum += x;
+            square_sum += x * x;
+        }
+
+        double sample_mean = sum / number_of_samples;
+        double sample_variance = square_sum / number_of_samples
+            - sample_mean * sample_mean;
+
+        if (std::abs(sample_mean - mean) >
+            5 * std::sqrt(variance / number_of_samples) ||
+            std::abs(sample_variance - variance) > 0.01 * variance) {
+            std::cout << "PhiloxSampler: " << name << " has mean "
+                      << sample_mean << " and variance " << sample_variance
+                      << ", expected " << mean << " and " << variance << '\n';
+            return false;
+        }
+
+        return true;
+    };
+
+    PhiloxSampler sampler (7, 1);
+    return check_moments("uniform", 0.5, 1.0 / 12.0,
+                         [&] { return sampler.generate(); }) &&
+        check_moments("small poisson", 3.5, 3.5,
+                      [&] { return sampler.poisson(3.5); }) &&
+        check_moments("large poisson", 250.0, 250.0,
+                      [&] { return sampler.poisson(250.0); }) &&
+        check_moments("gaussian", 0.0, 1.0,
+                      [&] { return sampler.gaussian(); }) &&
+        check_moments("exponential", 1.0, 1.0,
+                      [&] { return sampler.exponential(); });
+}
+
+
+// buffers put back into a BufferPool are handed out again for
+// requests in the same size class, and the pool keeps at most
+// max_free_buffers of each class.
+bool check_buffer_pool() {
+    BufferPool<int> pool (2);
+
+    std::vector<int> small = pool.get(100);
+    std::vector<int> large = pool.get(5000);
+    small.push_back(1);
+    int *small_data = small.data();
+    pool.put(std::move(small));
+    pool.put(std::move(large));
+
+    std::vector<int> reused = pool.get(200);
+    if (reused.data() != small_data || ! reused.empty()) {
+        std::cout << "BufferPool: buffer not reused\n";
+        return false;
+    }
+
+    // a short trajectory shouldn't get the large buffer, and a long
+    // one shouldn't get the small one
+    std::vector<int> fresh = pool.get(300);
+    if (pool.allocations != 3 || pool.reuses != 1) {
+        std::cout << "BufferPool: wrong allocation count\n";
+        return false;
+    }
+
+    pool.put(std::move(reused));
+    pool.put(std::move(fresh));
+    for (int i = 0; i < 4; i++) {
+        std::vector<int> buffer = pool.get(256);
+        pool.put(std::move(buffer));
+    }
+
+    if (pool.allocations != 3) {
+        std::cout << "BufferPool: steady state allocates\n";
+        return false;
+    }
+
+    for (int i = 0; i < 3; i++) {
+        std::vector<int> buffer;
+        buffer.reserve(256);
+        pool.put(std::move(buffer));
+    }
+
+    if (pool.free_buffers[0].size() != 2) {
+        std::cout << "BufferPool: too many free buffers kept\n";
+        return false;
+    }
+
+    return true;
+}
+
+
+// parse a condition and check it against a few states, with the counts
+// kept up to date from the changed entries like a simulation does. A
+// time condition holds from its threshold on, so it has to stop a
+// trajectory at the threshold rather than at the next step.
+bool check_stopping_condition() {
+    std::optional<StoppingCondition> condition = StoppingCondition::parse(
+        "state[1] >= 3 or (time >= 2 and count[0] <= 1) or fraction[2]>=0.5");
+
+    std::vector<int> state = {0, 0, 2, 1};
+    if (! condition || ! condition.value().compile(state)) {
+        std::cout << "stopping condition: didn't parse\n";
+        return false;
+    }
+
+    StoppingMonitor monitor;
+    monitor.start(&condition.value());
+
+    auto set = [&] (int i, int value) {
+        monitor.record_change(state[i], value);
+        state[i] = value;
+    };
+
+    // a single entry is 0 from time 1.5, and the next step is at 2.5
+    bool results[6];
+    results[0] = monitor.check(1.0, state);
+    set(0, 1);
+    results[1] = monitor.check(1.5, state);
+    results[2] = monitor.check_horizons(1.5, 2.5, state);
+
+    if (results[0] || results[1] || ! results[2] ||
+        monitor.first_passage_time != 2.0 || monitor.alternative != 1) {
+        std::cout << "stopping condition: wrong first passage\n";
+        return false;
+    }
+
+    // two entries are 0 when time 2 is reached, so the step is taken
+    monitor.start(&condition.value());
+    state = {0, 0, 2, 1};
+    results[3] = monitor.check_horizons(1.0, 2.5, state);
+    set(0, 1);
+    results[4] = monitor.check(2.5, state);
+
+    if (results[3] || ! results[4] ||
+        monitor.first_passage_time != 2.5 || monitor.alternative != 1) {
+        std::cout << "stopping condition: wrong first passage after time\n";
+        return false;
+    }
+
+    monitor.start(&condition.value());
+    state = {0, 0, 2, 1};
+    set(3, 2);
+    results[5] = monitor.check(0.5, state);
+    if (! results[5] || monitor.alternative != 2) {
+        std::cout << "stopping condition: fraction didn't hold\n";
+        return false;
+    }
+
+    std::vector<int> short_state = {0};
+    if (StoppingCondition::parse("state[1] >= 3 and") ||
+        StoppingCondition::parse("time <= 3") ||
+        StoppingCondition::parse("state[1] >= 1").value().compile(short_state)) {
+        std::cout << "stopping condition: bad condition accepted\n";
+        return false;
+    }
+
+    return true;
+}
+
+// A <-> B and A + B <-> C with mass action propensities, small
+// enough that a trajectory touches only part of the state.
+struct TestNetwork {
+    std::vector<int> initial_state = {40, 10, 0};
+    std::vector<double> initial_propensities;
+
+    TestNetwork() {
+        for (int j = 0; j < 4; j++)
+            initial_propensities.push_back(
+                compute_propensity(initial_state, j));
+    };
+
+    double compute_propensity(std::vector<int> &state, int reaction) {
+        switch (reaction) {
+        case 0: return 1.0 * state[0];
+        case 1: return 0.5 * state[1];
+        case 2: return 0.01 * state[0] * state[1];
+        default: return 0.2 * state[2];
+        }
+    };
+
+    int changed_state_entries(int reaction, int changed_state[4]) {
+        changed_state[0] = 0;
+        changed_state[1] = 1;
+        changed_state[2] = 2;
+        return reaction < 2 ? 2 : 3;
+    };
+
+    void update_state(std::vector<int> &state, int reaction) {
+        int changes[4][3] = {{-1, 1, 0}, {1, -1, 0}, {-1, -1, 1}, {1, 1, -1}};
+        for (int i = 0; i < 3; i++) state[i] += changes[reaction][i];
+    };
+
+    template <typename UpdateFunction>
+    void update_propensities(
+        UpdateFunction &&update_function,
+        std::vector<int> &state,
+        int) {
+
+        for (unsigned long int j = 0; j < 4; j++)
+            update_function(Update {
+                    .index = j,
+                    .propensity = compute_propensity(state, j)});
+    };
+};
+
+// a simulation which is reset to a seed has to produce the same
+// trajectory as one which was built with that seed.
+bool check_simulation_reset() {
+    TestNetwork model;
+    long int step_cutoff = 2000;
+    Simulation<TreeSolver, TestNetwork> simulation (model, 1, step_cutoff);
+    simulation.execute_steps(step_cutoff);
+
+    for (unsigned long int seed = 2; seed < 5; seed++) {
+        simulation.reset(seed);
+        simulation.execute_steps(step_cutoff);
+
+        Simulation<TreeSolver, TestNetwork> fresh (model, seed, step_cutoff);
+        fresh.execute_steps(step_cutoff);
+
+        std::vector<HistoryElement> &reset_history = simulation.history.chunk;
+        std::vector<HistoryElement> &fresh_history = fresh.history.chunk;
+        if (reset_history.size() != fresh_history.size() ||
+            simulation.state != fresh.state) {
+            std::cout << "reset: seed " << seed
+                      << " ended in a different state\n";
+            return false;
+        }
+
+        for (unsigned long int i = 0; i < fresh_history.size(); i++) {
+            if (reset_history[i].reaction_id != fresh_history[i].reaction_id ||
+                reset_history[i].time != fresh_history[i].time) {
+                std::cout << "reset: seed " << seed
+                          << " differs at step " << i << '\n';
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
 int main() {
     // TODO: make this into a test which passes or fails
     std::vector<double> initial_propensities = {0.1, 0.2, 0.3, 0.1, 0.1};
@@ -29,5 +459,36 @@ int main() {
             return 1;
         }
     }
+
+    if (! check_distribution<LinearSolver>("LinearSolver")) return 1;
+    if (! check_distribution<TreeSolver>("TreeSolver")) return 1;
+    if (! check_distribution<CompositionRejectionSolver>(
+            "CompositionRejectionSolver")) return 1;
+    if (! check_distribution<NextReactionSolver>(
+            "NextReactionSolver")) return 1;
+    if (! check_distribution<WideTreeSolver<8>>(
+            "WideTreeSolver<8>")) return 1;
+    if (! check_distribution<WideTreeSolver<16>>(
+            "WideTreeSolver<16>")) return 1;
+    if (! check_distribution<FenwickSolver>(
+            "FenwickSolver")) return 1;
+    if (! check_distribution<AliasSolver>(
+            "AliasSolver")) return 1;
+    if (! check_distribution<SortingLinearSolver>(
+            "SortingLinearSolver")) return 1;
+    if (! check_distribution<EqualRateSolver>(
+            "EqualRateSolver")) return 1;
+    if (! check_distribution<MixedPrecisionTreeSolver>(
+            "MixedPrecisionTreeSolver")) return 1;
+    if (! check_against_reference<MixedPrecisionTreeSolver, TreeSolver>(
+            "MixedPrecisionTreeSolver")) return 1;
+    if (! check_distribution<UniformizationSolver>(
+            "UniformizationSolver")) return 1;
+    if (! check_uniformization_bound()) return 1;
+    if (! check_philox_sampler()) return 1;
+    if (! check_buffer_pool()) return 1;
+    if (! check_stopping_condition()) return 1;
+    if (! check_simulation_reset()) return 1;
+
     return 0;
 }
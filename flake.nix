@@ -21,7 +21,7 @@
 
 
             buildPhase = "CC=clang++ ./build.sh";
-            installPhase = "mkdir -p $out/bin; mv ./build/* $out/bin";
+            installPhase = "mkdir -p $out/bin; mv ./build/GMC ./build/NPMC ./build/test_core $out/bin";
             doCheck = true;
             checkPhase = "./test.sh";
 
@@ -5,10 +5,10 @@ Color_Off="\033[0m"       # Text Reset
 function test_core {
     if ./build/test_core
     then
-        echo -e "${Green} passed: linear and tree samplers agree ${Color_Off}"
+        echo -e "${Green} passed: core solver tests ${Color_Off}"
         RC=0
     else
-        echo -e "${Red} failed: linear and tree samplers disagree ${Color_Off}"
+        echo -e "${Red} failed: core solver tests ${Color_Off}"
         RC=1
     fi
 
@@ -19,7 +19,7 @@ function test_gmc {
 
     cp $GMC_TEST_DIR/initial_state.sqlite $GMC_TEST_DIR/initial_state_copy.sqlite
 
-    ./build/GMC --reaction_database=$GMC_TEST_DIR/rn.sqlite --initial_state_database=$GMC_TEST_DIR/initial_state_copy.sqlite --number_of_simulations=1000 --base_seed=1000 --thread_count=2 --step_cutoff=200 --dependency_threshold=1 &> /dev/null
+    ./build/gsl/GMC --reaction_database=$GMC_TEST_DIR/rn.sqlite --initial_state_database=$GMC_TEST_DIR/initial_state_copy.sqlite --number_of_simulations=1000 --base_seed=1000 --thread_count=2 --step_cutoff=200 --dependency_threshold=1 &> /dev/null
 
     sql='SELECT seed, step, reaction_id FROM trajectories ORDER BY seed ASC, step ASC;'
 
@@ -48,7 +48,7 @@ function test_npmc {
 
     # to check for leaks with valgrind, you need to use the option --fair-sched=yes
 
-    ./build/NPMC --nano_particle_database=$NPMC_TEST_DIR/np.sqlite --initial_state_database=$NPMC_TEST_DIR/initial_state_copy.sqlite --number_of_simulations=1000 --base_seed=1000 --thread_count=2 --step_cutoff=200 &> /dev/null
+    ./build/gsl/NPMC --nano_particle_database=$NPMC_TEST_DIR/np.sqlite --initial_state_database=$NPMC_TEST_DIR/initial_state_copy.sqlite --number_of_simulations=1000 --base_seed=1000 --thread_count=2 --step_cutoff=200 &> /dev/null
 
     sql='SELECT seed, step, site_id_1, site_id_2, interaction_id FROM trajectories ORDER BY seed ASC, step ASC;'
 